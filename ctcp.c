@@ -25,6 +25,35 @@
  */
 static ctcp_state_t *state_list;
 
+/**
+ * Connections waiting to send, one scheduler per shaper class, ordered by
+ * departure time. ctcp_pacing_timer() serves them from here, earliest first.
+ */
+static ctcp_sched_t departures[SHAPER_CLASSES];
+
+/**
+ * Connections holding back an ACK, ordered by when it is due.
+ * ctcp_pacing_timer() sends those that are due.
+ */
+static ctcp_sched_t delayed_acks;
+
+/**
+ * Connections with a retransmission timer, RACK reordering timer or tail loss
+ * probe armed, ordered by when the earliest of them is due.
+ * ctcp_pacing_timer() runs those that are due.
+ */
+static ctcp_sched_t loss_timers;
+
+/**
+ * Token bucket for config.total_rate, shared by all connections. Credit is in
+ * bytes scaled by USEC_PER_SEC like a connection's pacing credit.
+ */
+static struct {
+  uint64_t rate;
+  int64_t credit;
+  uint64_t refill_us;
+} total_bucket;
+
 
 ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   /* Connection could not be established. */
@@ -44,19 +73,21 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   /* Set fields. */
   state->conn = conn;
   /* FIXME: Do any other initialization here. */
-  state->segments = ll_create();
-  state->waiting_segments = ll_create();
-  state->received_segments = ll_create();
-
   state->curr_seqno=1;
+  sndbuf_init(&state->tx_buffer, state->curr_seqno);
   state->curr_ackno=1;
-  state->rx_next_output_seqno=1;
   
   state->tx_in_flight_bytes=0;
-  state->rx_waiting_bytes=0;
 
   state->config = *cfg;
   free(cfg);
+  rcvbuf_init(&state->rx_buffer, state->curr_ackno, state->config.recv_window);
+  state->acked_seqno = state->curr_ackno;
+  state->ack_rate = MIN(2, state->config.ack_frequency); // RFC 1122: every second full segment.
+  state->ack_index = SCHED_NOT_QUEUED;
+  state->loss_index = SCHED_NOT_QUEUED;
+  state->rto_us = (uint64_t)state->config.rt_timeout * 1000;
+  state->rack_reo_wnd_mult = 1;
   
   state->termination_state=CONN_ESTABLISHED;
   state->time_wait_in_ms=0;
@@ -65,12 +96,28 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->cwnd = CTCP_INITIAL_CWND;
   /* pacing setup */
   state->pacing_rate = CTCP_INITIAL_CWND * MAX_SEG_DATA_SIZE;
-  state->pacing_gap_us = MAX(10, ((uint64_t)(MAX_SEG_DATA_SIZE))*1000000 / state->pacing_rate);
-  // get_time(&(state->pacing_last_timeout));
-  clock_gettime(CLOCK_MONOTONIC, &(state->pacing_last_timeout));
+  if(state->config.max_pacing_rate){
+    state->pacing_rate = MIN(state->pacing_rate, state->config.max_pacing_rate);
+  }
+  state->pacing_credit = 0;
+  state->pacing_refill_us = monotonic_current_time_us();
+  state->next_departure_us = 0;
+  state->sched_index = SCHED_NOT_QUEUED;
+  state->shaper_deficit = 0;
+  if(total_bucket.rate == 0 && state->config.total_rate){
+    total_bucket.rate = state->config.total_rate;
+    total_bucket.refill_us = monotonic_current_time_us();
+  }
+  memset(&state->pacing_stats, 0, sizeof(state->pacing_stats));
 
   state->bbr_model = ctcp_bbr_create_model(state);
 
+  /* The handshake RTT stands in for a first sample, so the RTO fits the path
+     before any data has been acked. */
+  if(state->config.handshake_rtt_us){
+    rtt_sample(state, state->config.handshake_rtt_us);
+  }
+
   fopen("bdp.txt", "w");
 
   return state;
@@ -82,108 +129,398 @@ void ctcp_destroy(ctcp_state_t *state) {
     state->next->prev = state->prev;
 
   *state->prev = state->next;
+  sched_remove(class_departures(state), &state->sched_index);
+  sched_remove(&delayed_acks, &state->ack_index);
+  sched_remove(&loss_timers, &state->loss_index);
   conn_remove(state->conn);
 
   /* FIXME: Do any other cleanup here. */
   // Free up the memory taken up by the objects contained within the nodes 
   // because ll_destroy DOES NOT free up them.
-  ll_free_objects(state->segments);
-  ll_destroy(state->segments);
-  ll_free_objects(state->waiting_segments);
-  ll_destroy(state->waiting_segments);
-  ll_free_objects(state->received_segments);
-  ll_destroy(state->received_segments);
+  uint32_t i;
+  for(i = state->tx_buffer.head; i != state->tx_buffer.next; i++){
+    bbr_free_rate_sample(sndbuf_desc(&state->tx_buffer, i)->rs);
+  }
+  sndbuf_destroy(&state->tx_buffer);
+  rcvbuf_destroy(&state->rx_buffer);
 
   if(state->bbr_model){
     free(state->bbr_model->bbr_object);
     free(state->bbr_model);
   }
 
+  if(state->config.conn_stats){
+    print_conn_stats(state);
+  }
+
   free(state);
+
+  /* The schedulers are shared by all connections. Give their memory back with
+     the last one; they start out empty again with the next. */
+  if(!state_list){
+    int c;
+    for(c = 0; c < SHAPER_CLASSES; c++){
+      sched_destroy(&departures[c]);
+    }
+    sched_destroy(&delayed_acks);
+    sched_destroy(&loss_timers);
+  }
   end_client();
 }
 
 /**
-  Send segments in Tx buffer(waiting_segments linked list).
+  Record the gap between this departure and the previous one against the gap
+  the pacing rate asks for.
+*/
+void record_departure(ctcp_state_t* state, uint64_t departure_us, uint32_t data_sz){
+  ctcp_pacing_stats_t *stats = &state->pacing_stats;
+  if(stats->backlogged && state->pacing_rate){
+    uint64_t target_us = (uint64_t)data_sz * USEC_PER_SEC / state->pacing_rate;
+    uint64_t actual_us = departure_us - stats->last_departure_us;
+    uint64_t err_us = actual_us > target_us ? actual_us - target_us : target_us - actual_us;
+    stats->gaps += 1;
+    stats->target_sum_us += target_us;
+    stats->actual_sum_us += actual_us;
+    stats->abs_err_sum_us += err_us;
+    stats->max_err_us = MAX(stats->max_err_us, err_us);
+  }
+  stats->last_departure_us = departure_us;
+  stats->segments += 1;
+  stats->bytes += data_sz;
+  stats->backlogged = sndbuf_unsent(&state->tx_buffer) > 0;
+}
+
+/**
+  Count a retransmission. Retransmissions leaving at the same time (in the same
+  pass of the event loop) form a burst that hits the bottleneck at line rate.
+*/
+void record_retransmit(ctcp_state_t* state, uint64_t departure_us){
+  ctcp_pacing_stats_t *stats = &state->pacing_stats;
+  if(stats->retransmits == 0 || departure_us != stats->last_retrans_us){
+    stats->retrans_bursts += 1;
+    stats->retrans_burst = 0;
+  }
+  stats->retransmits += 1;
+  stats->retrans_burst += 1;
+  stats->max_retrans_burst = MAX(stats->max_retrans_burst, stats->retrans_burst);
+  stats->last_retrans_us = departure_us;
+}
+
+/**
+ * Checks whether the in-order data received since the last delivery has
+ * reached a coalescing limit and should be delivered and acked now rather
+ * than at the end of the receive batch.
+ *
+ * returns true if a limit is reached.
+ */
+bool gro_limit_reached(ctcp_state_t *state){
+  ctcp_config_t *cfg = &state->config;
+  if(cfg->gro_segments && state->gro_segments >= cfg->gro_segments){
+    return true;
+  }
+  return cfg->gro_bytes && rcvbuf_ready(&state->rx_buffer) >= cfg->gro_bytes;
+}
+
+/**
+  Report the connection's counters as it closes, one line per feature that had
+  something to count.
+*/
+void print_conn_stats(ctcp_state_t* state){
+  if(state->rx_deliveries){
+    fprintf(stderr, "[GRO] %lu in-order segments in %lu deliveries, %lu ACKs, %.2f segments per ACK\n",
+            state->rx_segments, state->rx_deliveries, state->acks_sent,
+            (double)state->rx_segments / MAX(state->acks_sent, 1));
+  }
+  if(state->sacked_segments){
+    fprintf(stderr, "[SACK] %lu segments selectively acked, %lu taken as lost\n",
+            state->sacked_segments, state->sack_lost_segments);
+  }
+  if(state->rack_lost_segments || state->tlp_probes){
+    fprintf(stderr, "[RACK] %lu segments taken as lost, %lu tail loss probes\n",
+            state->rack_lost_segments, state->tlp_probes);
+  }
+  if(state->rto_timeouts){
+    fprintf(stderr, "[RTO] srtt %lu us, rttvar %lu us, rto %lu us, %lu timeouts\n",
+            state->srtt_us, state->rttvar_us, state->rto_us, state->rto_timeouts);
+  }
+  if(state->spurious_eifel || state->spurious_frto){
+    fprintf(stderr, "[UNDO] spurious retransmissions undone: %lu found by timestamps, %lu timeouts found by F-RTO\n",
+            state->spurious_eifel, state->spurious_frto);
+  }
+  print_pacing_stats(state);
+}
+
+/**
+  Report how closely departures kept to the pacing rate, and how
+  retransmissions bunched up.
+*/
+void print_pacing_stats(ctcp_state_t* state){
+  ctcp_pacing_stats_t *stats = &state->pacing_stats;
+  if(stats->segments){
+    fprintf(stderr, "[PACING] %lu segments, %lu bytes/segment, %lu partial segments held by autocork\n",
+            stats->segments, stats->bytes / stats->segments, state->corked_segments);
+  }
+  if(stats->retransmits){
+    fprintf(stderr, "[PACING] %lu retransmissions in %lu bursts, mean burst %.2f, max burst %lu\n",
+            stats->retransmits, stats->retrans_bursts,
+            (double)stats->retransmits / stats->retrans_bursts, stats->max_retrans_burst);
+  }
+  if(stats->gaps == 0){
+    fprintf(stderr, "[PACING] %s: no back-to-back departures measured.\n",
+            state->config.txtime ? "SO_TXTIME" : "userspace");
+    return;
+  }
+  fprintf(stderr, "[PACING] %s: %lu gaps, mean target %lu us, mean achieved %lu us, "
+          "mean |error| %lu us, max |error| %lu us\n",
+          state->config.txtime ? "SO_TXTIME" : "userspace", stats->gaps,
+          stats->target_sum_us / stats->gaps, stats->actual_sum_us / stats->gaps,
+          stats->abs_err_sum_us / stats->gaps, stats->max_err_us);
+}
+
+/**
+  Hand a segment to the network at its paced departure time: right away, or with
+  SO_TXTIME at next_departure_us, which then moves out by this segment's share of
+  the pacing rate.
+  returns the departure time, which is when the segment is sent. RTT samples,
+  RACK and timestamps count from it rather than from the hand-off to the qdisc.
+*/
+uint64_t depart_segment(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint32_t data_sz, uint64_t now_us){
+  uint64_t departure_us = state->config.txtime ?
+      MAX(state->next_departure_us, now_us) : now_us;
+  int sent;
+  trans_info->xmit_time_us = departure_us; // Also its timestamp.
+  if(state->config.txtime){
+    // Let the qdisc hold the segment until its departure time, then move
+    // the next departure out by this segment's share of the pacing rate.
+    sent = transmit_segment(state, trans_info, departure_us);
+    state->next_departure_us = departure_us + (state->pacing_rate ?
+        (uint64_t)data_sz * USEC_PER_SEC / state->pacing_rate : 0);
+  }else{
+    sent = transmit_segment(state, trans_info, 0);
+  }
+  record_departure(state, departure_us, data_sz);
+  if(sent == 0){
+    _log_info("[Tx] Nothing was sent.\n");
+  }else if(sent==-1){
+    _log_info("[Tx] Error occured while conn_send waiting segment.\n");
+  }else{
+    _log_info("[Tx] waiting segment was sent.\n");
+  }
+  trans_info->num_of_transmission += 1;
+  if(state->rto_timeout_us == 0){
+    rto_arm(state, departure_us);
+  }
+  return departure_us;
+}
+
+/**
+  Send the oldest segment waiting for retransmission. It goes out in the next
+  pacing slot ahead of new data, and only if cwnd has room for it once the lost
+  bytes are taken out of flight.
+  returns the data bytes sent, 0 if nothing was sent.
+*/
+int send_retransmission(ctcp_state_t* state){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  uint32_t i;
+  for(i = tx_buffer->head; i != tx_buffer->next; i++){
+    if(sndbuf_desc(tx_buffer, i)->retrans_pending){
+      break;
+    }
+  }
+  if(i == tx_buffer->next){
+    return 0;
+  }
+
+  collapse_retransmit(state, i);
+  ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, i);
+  const uint32_t data_sz = ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+  if((pipe_bytes(state) + data_sz) > (state->cwnd * MAX_SEG_DATA_SIZE)){
+    _log_info("[RETRANSMIT] cwnd is full. Wait to retransmit %d bytes.\n", data_sz);
+    return 0;
+  }
+
+  _log_info("[RETRANSMIT] Transmit %d-th time.\n", trans_info->num_of_transmission);
+  trans_info->retrans_pending = false;
+  state->lost_bytes -= data_sz;
+  // The segment is rebuilt from the Tx buffer with the up-to-date ackno.
+  record_retransmit(state, depart_segment(state, trans_info, data_sz, monotonic_current_time_us()));
+  if(state->undo_recover && state->undo_end_seqno == 0 && !state->undo_lost){
+    // The first retransmission of the recovery: its ACK shows whether it was needed.
+    state->undo_end_seqno = ntohl(trans_info->segment.seqno) + data_sz;
+    state->undo_tsval = (uint32_t)trans_info->xmit_time_us;
+  }
+  return data_sz;
+}
+
+/**
+  Send the next segment in the pacing slot: a pending retransmission first,
+  otherwise a new segment cut from the unsent bytes in Tx buffer.
   This is called by pacing timer.(which means called at every pacing interval (send-time).)
+  Segments are sized at departure, so they carry whatever has been read by then.
+  returns the data bytes sent, 0 if nothing was sent.
 */
-void send_front_segment_in_tx_buffer(ctcp_state_t* state){
-  if(ll_length(state->waiting_segments) > 0){
-    ll_node_t *curr_node = ll_front(state->waiting_segments);
-    
-    ctcp_transmission_info_t *trans_info = (ctcp_transmission_info_t*)(curr_node->object);
-    ctcp_segment_t *pending_segment = &(trans_info->segment);
-    const uint32_t data_sz = ntohs(pending_segment->len) - HDR_CTCP_SEGMENT;
+int send_front_segment_in_tx_buffer(ctcp_state_t* state){
+  // F-RTO tests a timeout with new data, so retransmissions wait meanwhile.
+  if(state->frto == FRTO_SECOND_ACK){
+    if(state->frto_new_segments >= FRTO_NEW_SEGMENTS){
+      return 0;
+    }
+  }else if(state->lost_bytes > 0){
+    return send_retransmission(state);
+  }
+
+  uint32_t unsent = sndbuf_unsent(&state->tx_buffer);
+  if(unsent > 0){
+    const uint32_t data_sz = MIN(unsent, MAX_SEG_DATA_SIZE);
+    if(should_cork(state, data_sz)){
+      return 0;
+    }
     
     // Before sending, first check if receiver's buffer is available.(Flow control)
-    // If available, send the segment.
-    if((state->tx_in_flight_bytes + data_sz) <= (state->cwnd * MAX_SEG_DATA_SIZE)){
-      // send pending segments after update up-to-date ackno and cksum.
-      ctcp_transmission_info_t *curr_trans_info = (ctcp_transmission_info_t*)(ll_remove(state->waiting_segments, curr_node));
-      ctcp_segment_t *curr_segment = &(curr_trans_info->segment);
-      state->tx_in_flight_bytes += (ntohs(curr_segment->len) - HDR_CTCP_SEGMENT);
-      // update segment's acknowledgement number to up-to-date ackno.
-      curr_segment->ackno = htonl(state->curr_ackno);
-      curr_segment->cksum = 0;
-      curr_segment->cksum = cksum(curr_segment, htons(curr_segment->len)); // update checksum since segment's ackno might be changed.
+    // If available and cwnd allows it, send the segment.
+    if((state->tx_in_flight_bytes + data_sz) <= state->config.send_window
+      && (pipe_bytes(state) + data_sz) <= (state->cwnd * MAX_SEG_DATA_SIZE)){
+      ctcp_transmission_info_t *curr_trans_info = sndbuf_cut(&state->tx_buffer, TH_ACK, data_sz);
+      state->tx_in_flight_bytes += data_sz;
       
       if(state->bbr_model){
         state->bbr_model->on_send(state, curr_trans_info, state->bbr_model->bbr_object);
       }
       
-      curr_trans_info->send_time_us = monotonic_current_time_us();
-      int sent = conn_send(state->conn, curr_segment, ntohs(curr_segment->len));
-      if(sent == 0){
-        _log_info("[Tx] Nothing was sent.\n");
-      }else if(sent==-1){
-        _log_info("[Tx] Error occured while conn_send waiting segment.\n");
-      }else{
-        _log_info("[Tx] waiting segment was sent.\n");
-        print_hdr_ctcp(curr_segment);
+      curr_trans_info->send_time_us = depart_segment(state, curr_trans_info, data_sz,
+          monotonic_current_time_us());
+      if(state->frto == FRTO_SECOND_ACK){
+        state->frto_new_segments += 1;
       }
-
-      // store transmitted segments to 'segments'(a buffer to save inflight segments)
-      curr_trans_info->num_of_transmission += 1;
-      ll_add(state->segments, curr_trans_info);
-      
+      if(state->tlp_timeout_us == 0){
+        tlp_arm(state, curr_trans_info->send_time_us);
+      }
+      update_input_throttle(state);
+      return data_sz;
       
     }else{
-      _log_info("[Tx] If sending %d bytes of pending data, in-flight bytes(%d) will overflow receiver's window size(%d). Wait to send.\n",
-          data_sz, state->tx_in_flight_bytes, state->config.send_window);
+      _log_info("[Tx] If sending %d bytes of pending data, in-flight bytes(%d) will overflow receiver's window size(%d) or cwnd(%u segments). Wait to send.\n",
+          data_sz, state->tx_in_flight_bytes, state->config.send_window, state->cwnd);
     }
     
 
   }else{
-    // If no packet to send in tx queue, update app_limited_until value to current size of inflight packets.
-    if(state->bbr_model){
-      ctcp_bbr_t* bbr = (ctcp_bbr_t*)(state->bbr_model->bbr_object);
-      bbr->app_limited_until = state->tx_in_flight_bytes;
-    }
+    mark_app_limited(state);
+  }
+  return 0;
+}
+
+/**
+  If no packet to send in tx queue, update app_limited_until value to current size
+  of inflight packets.
+*/
+void mark_app_limited(ctcp_state_t* state){
+  if(state->bbr_model){
+    ctcp_bbr_t* bbr = (ctcp_bbr_t*)(state->bbr_model->bbr_object);
+    bbr->app_limited_until = state->tx_in_flight_bytes;
+  }
+}
+
+/**
+  Not-sent low-watermark in bytes: the configured value, otherwise the BDP BBR has
+  measured (at least bbr_cwnd_min_target segments), otherwise the cwnd.
+  With about a BDP in flight under cwnd, this keeps the Tx buffer near 2 * BDP.
+*/
+uint32_t notsent_lowat(ctcp_state_t* state){
+  if(state->config.notsent_lowat){
+    return state->config.notsent_lowat;
+  }
+  uint64_t lowat = (uint64_t)state->cwnd * MAX_SEG_DATA_SIZE;
+  if(state->bbr_model){
+    ctcp_bbr_t* bbr = (ctcp_bbr_t*)(state->bbr_model->bbr_object);
+    lowat = bdp_in_bytes(bbr, BBR_UNIT);
+  }
+  return MIN(MAX(lowat, bbr_cwnd_min_target * MAX_SEG_DATA_SIZE), SNDBUF_MAX_BYTES);
+}
+
+/**
+  Stop polling input while the unsent bytes are at the low-watermark (or the Tx
+  buffer is full), and resume once sending has brought them below it. Once this
+  host has sent its FIN the input is done for good. A pipe at EOF keeps polling
+  as hung up, so it would otherwise wake ctcp_read() in a busy loop.
+*/
+void update_input_throttle(ctcp_state_t* state){
+  bool fin_sent = state->termination_state != CONN_ESTABLISHED
+    && state->termination_state != CLOSE_WAIT;
+  conn_throttle_input(state->conn, fin_sent
+      || sndbuf_unsent(&state->tx_buffer) >= notsent_lowat(state) || sndbuf_full(&state->tx_buffer));
+}
+
+/**
+  Autocork: hold back a partial segment while earlier data is still in flight, so
+  small writes that follow are sent with it. The ACK for all the in-flight data,
+  input that fills the segment or autocork_us running out ends the hold. Nothing
+  is held on an idle connection, so the first byte goes out right away.
+  returns whether to hold the unsent data for now.
+*/
+bool should_cork(ctcp_state_t* state, uint32_t data_sz){
+  uint64_t expiry_us = cork_expiry_us(state, data_sz);
+  if(expiry_us == 0 || monotonic_current_time_us() >= expiry_us){
+    state->corked = false;
+    return false;
+  }
+  if(!state->corked){
+    state->corked = true;
+    state->corked_segments += 1;
+  }
+  return true;
+}
+
+/**
+  returns when autocork stops holding a data_sz-byte segment, 0 if it isn't held.
+*/
+uint64_t cork_expiry_us(ctcp_state_t* state, uint32_t data_sz){
+  if(data_sz >= MAX_SEG_DATA_SIZE || state->tx_in_flight_bytes == 0
+    || state->config.autocork_us == 0){
+    return 0;
   }
+  return state->unsent_since_us + state->config.autocork_us;
 }
 
 void ctcp_read(ctcp_state_t *state) {
-  uint8_t stdin_buf[MAX_SEG_DATA_SIZE];
-  memset(stdin_buf, 0, MAX_SEG_DATA_SIZE); // Clean memory
+  struct iovec iov[2];
+  int iovcnt;
   int stdin_data_sz = 0;
+  uint32_t lowat = notsent_lowat(state);
 
-  /* Read STDIN into buf until no data is available */
-  if((stdin_data_sz = conn_input(state->conn, stdin_buf, MAX_SEG_DATA_SIZE)) > 0){
-    /* Create a single segment(Segment size is up to 1 * MAX_SEG_DATA_SIZE) for lab3-1 */
-    ctcp_transmission_info_t *trans_info = create_segment(state, TH_ACK, stdin_data_sz, stdin_buf);
-    _log_info("[TX]Segment is created. ");
-    ctcp_segment_t *segment = &(trans_info->segment);
-    print_hdr_ctcp(segment);
-    
-    // Enqueue the segment to Tx buffer
-    ll_add(state->waiting_segments, trans_info);
-    _log_info("# of waiting segments: %d.\n", state->waiting_segments->length);
+  if(sndbuf_unsent(&state->tx_buffer) == 0){
+    state->unsent_since_us = monotonic_current_time_us();
+  }
+
+  /* A regular input file is mapped and queued whole. Segments are views into
+     the mapping, so it is never read or copied into the Tx buffer. */
+  const void *map;
+  ssize_t map_len = conn_input_mapped(state->conn, &map);
+  if(map_len > 0){
+    sndbuf_attach(&state->tx_buffer, map, map_len);
+    state->curr_seqno += map_len; // Update sequence number.
+    _log_info("[TX]%zd bytes of input file were mapped.\n", map_len);
   }
 
+  /* Read STDIN straight into the Tx buffer until no data is available or the
+     unsent bytes reach the low-watermark. Segments are cut from these bytes
+     when they are sent. */
+  while((iovcnt = sndbuf_write_space(&state->tx_buffer, iov,
+          lowat - MIN(lowat, sndbuf_unsent(&state->tx_buffer)))) > 0){
+    stdin_data_sz = conn_inputv(state->conn, iov, iovcnt);
+    if(stdin_data_sz <= 0){
+      break;
+    }
+    sndbuf_commit(&state->tx_buffer, stdin_data_sz);
+    state->curr_seqno += stdin_data_sz; // Update sequence number.
+    _log_info("[TX]%d bytes were read. # of unsent bytes: %u.\n", stdin_data_sz, sndbuf_unsent(&state->tx_buffer));
+  }
+  update_input_throttle(state);
+  schedule_connection(state);
+
   /* Termination when input EOF and no inflight/pending segments */
   if(stdin_data_sz==-1 /* EOF */
-    && ll_length(state->segments) ==0 /* No in-flight segments */
-    && ll_length(state->waiting_segments) == 0 /* No pending segments to be sent */
+    && sndbuf_empty(&state->tx_buffer) /* No in-flight or pending segments */
   ){
     /* Termination */
     _log_info("[tcp termination]EOF was entered. Termination initiated.\n");
@@ -193,10 +530,9 @@ void ctcp_read(ctcp_state_t *state) {
       This host's TCP sends a segment with the FIN bit set to request that the connection be closed. 
       ESTABLISHED -> FIN_WAIT_1*/
       uint8_t dummy = 0; /* dummy data for FIN. FIN is considered as 1-byte segment. */
-      // ctcp_transmission_info_t *fin_trans_info = (ctcp_transmission_info_t*)create_segment(state->curr_seqno, state->curr_ackno, TH_FIN, FIN_SEGMENT_DATA_SIZE, &dummy);
-      ctcp_transmission_info_t *fin_trans_info = (ctcp_transmission_info_t*)create_segment(state, TH_FIN, FIN_SEGMENT_DATA_SIZE, &dummy);
+      create_segment(state, FIN_SEGMENT_DATA_SIZE, &dummy);
       _log_info("[tcp termination]Client state transitions from CONN_ESTABLISHED to FIN_WATI1.\n");
-      send_segment(state, fin_trans_info, FIN_SEGMENT_DATA_SIZE);
+      send_segment(state, TH_FIN, FIN_SEGMENT_DATA_SIZE);
       state->termination_state = FIN_WAIT_1;
     }
     else if(state->termination_state == CLOSE_WAIT){
@@ -204,17 +540,22 @@ void ctcp_read(ctcp_state_t *state) {
       This host sends its FIN to the other host. 
       CLOSE_WAIT -> LAST_ACK */
       uint8_t dummy = 0; /* dummy data for FIN. FIN is considered as 1-byte segment. */
-      // ctcp_transmission_info_t *fin_trans_info = (ctcp_transmission_info_t*)create_segment(state->curr_seqno, state->curr_ackno, TH_FIN, FIN_SEGMENT_DATA_SIZE, &dummy);
-      ctcp_transmission_info_t *fin_trans_info = (ctcp_transmission_info_t*)create_segment(state, TH_FIN, FIN_SEGMENT_DATA_SIZE, &dummy);
+      create_segment(state, FIN_SEGMENT_DATA_SIZE, &dummy);
       _log_info("[tcp termination]Server state transitions from CLOSE_WAIT to LAST_ACK.\n");
-      send_segment(state, fin_trans_info, FIN_SEGMENT_DATA_SIZE);
+      send_segment(state, TH_FIN, FIN_SEGMENT_DATA_SIZE);
       state->termination_state = LAST_ACK;
     }
+    update_input_throttle(state);
   }
 }
 
 void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
-  uint64_t receive_time_us = monotonic_current_time_us();
+  /* Prefer the kernel's receive timestamp so RTT samples reflect the network
+     rather than how long the event loop took to get here. */
+  uint64_t receive_time_us = conn_rx_time_us(state->conn);
+  if(receive_time_us == 0){
+    receive_time_us = monotonic_current_time_us();
+  }
   assert(ntohs(segment->len) == len);
 
   _log_info("[RX]Segment is received. len: %lu ", len);
@@ -247,7 +588,7 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
       is_termination_state_transitioned = 1;
     }else{
       /* Waiting for ACK for its FIN. */
-      if(ll_remove_acked_segments(state->segments, segment->ackno)){
+      if(release_acked_segments(state, ntohl(segment->ackno), receive_time_us, false)){
         /* If this host receives the ACK for its FIN, transition to FIN_WAIT_2 
         FIN_WAIT_1 -> FIN_WAIT_2*/
         state->termination_state = FIN_WAIT_2;
@@ -268,7 +609,7 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   }else if(state->termination_state == CLOSING){
     /* If this host receives the ACK for its FIN, transition to TIME_WAIT no matter it is client or server. 
     CLOSING -> TIME_WAIT */
-    if(ll_remove_acked_segments(state->segments, segment->ackno)){
+    if(release_acked_segments(state, ntohl(segment->ackno), receive_time_us, false)){
       _log_info("CLOSING -> TIME_WAIT\n");
       state->termination_state = TIME_WAIT;
       is_termination_state_transitioned = 1;
@@ -277,7 +618,7 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
     /* This host is waiting for an ACK for the FIN it sent. 
     If this host receives the ACK to its FIN, closes the connection.
     LAST_ACK -> CLOSED. DESTROY THE CONNECTION. */
-    if(ll_remove_acked_segments(state->segments, segment->ackno)){
+    if(release_acked_segments(state, ntohl(segment->ackno), receive_time_us, false)){
       _log_info("LAST_ACK -> CLOSED\n");
       state->termination_state = CLOSED;
       free(segment);
@@ -305,109 +646,128 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   /* If received segment is ACK, update ackno. */
   if(is_ack(state, segment)){
     _log_info("ACK segment received.\n");
-    /* Remove all sent segments that has acked from transmission buffer(='state->segments' linked list)*/
-
-    ll_node_t* curr = ll_front(state->segments);
-    while(curr){
-      ctcp_transmission_info_t *curr_trans_info = (ctcp_transmission_info_t*)curr->object;
-      ctcp_segment_t *curr_segment = &(curr_trans_info->segment);
-      if( (curr_segment->flags & TH_ACK) && ntohl(curr_segment->seqno) < ntohl(segment->ackno)){
-        uint16_t size_of_acked_segments = (ntohs(curr_segment->len) - HDR_CTCP_SEGMENT);
-        _log_info("%d bytes of segment data was acked. tx_in_flight_bytes %d->", size_of_acked_segments, state->tx_in_flight_bytes);
-        state->tx_in_flight_bytes -= size_of_acked_segments;
-        fprintf(stderr,"%d.\n", state->tx_in_flight_bytes);
-        curr_trans_info->ack_time_us = receive_time_us;
-        if(state->bbr_model) {
-          state->bbr_model->on_ack(state, curr_trans_info);
-        }
-        ll_node_t *remove_node = curr;
-        curr = curr->prev;
-        ll_remove(state->segments, remove_node);
-        free(curr_trans_info);
-      }
-      if(curr==NULL){
-        break;
-      }else{
-        curr = curr->next;
+    detect_spurious_retransmission(state, ntohl(segment->ackno), conn_rx_options(state->conn));
+    /* Release all sent segments that has acked from transmission buffer. */
+    release_acked_segments(state, ntohl(segment->ackno), receive_time_us, true);
+    if(state->config.sack){
+      update_scoreboard(state, conn_rx_options(state->conn), receive_time_us);
+    }
+    if(state->config.rack){
+      uint64_t now_us = monotonic_current_time_us();
+      if(state->tlp_end_seqno && state->tx_buffer.start_seqno >= state->tlp_end_seqno){
+        state->tlp_end_seqno = 0; // The probe got through. Another may go out.
       }
+      rack_detect_loss(state, now_us);
+      tlp_arm(state, now_us);
     }
 
     free(segment);
     return;
   }
   
-  /* If segment is newly received data, add it to receiver buffer in proper index.
-   * Otherwise, drop it. 
+  /* If segment is newly received data, copy it to its place in the receiver
+   * buffer. Bytes that were received before or are beyond the receive window
+   * are dropped.
    */
-  if(is_new_data_segment(state, segment)){
-    ll_node_t *added_node = ll_add_in_order(state->received_segments, segment);
-    if(added_node){
-      state->rx_waiting_bytes += (len - HDR_CTCP_SEGMENT); //Increase size of data that received but not output.
-      _log_info("Current Rx buffer size waiting for output / rcvr buffer: %d/%d after added.\n", state->rx_waiting_bytes, state->config.recv_window);
+  const ctcp_options_t *options = conn_rx_options(state->conn);
+  if(options->ack_rate){
+    state->ack_rate = MIN(options->ack_rate, state->config.ack_frequency);
+  }
+  /* Echo the timestamp of the earliest segment the next ACK covers, so a late
+     original and its retransmission are told apart (RFC 7323). */
+  if(state->config.timestamps && options->timestamps && ntohl(segment->seqno) <= state->acked_seqno
+    && (state->ts_recent == 0 || !TS_BEFORE(options->ts_val, state->ts_recent))){
+    state->ts_recent = options->ts_val;
+  }
 
-    }else{
-      /* If it was not added into receiver buffer, Drop the packet(segment). */
-      free(segment);
-    }
-    
-    // if this host's receiver buffer overflows, drop packets until receiver buffer is available.
-    // 아래 필요??
-    while(state->rx_waiting_bytes > state->config.recv_window){
-      // 받았지만 output을 기다리고 있는 데이터의 크기가 sender로부터 받을 수 있는 용량보다 클 때. 
-      // 즉, receiver buffer 적절한 위치에 hole을 채워 넣은 후 receiver buffer window size보다 크면 맨 뒤(큰 seqno)부터 제거
-      ll_node_t *last_node = ll_back(state->received_segments);
-      ctcp_segment_t *s = (ctcp_segment_t*)(last_node->object);
-      state->rx_waiting_bytes -= ntohl(s->len) - HDR_CTCP_SEGMENT;
-      ctcp_segment_t *drop = (ctcp_segment_t*)ll_remove(state->received_segments, last_node); // Drop the segment.
-      free(drop);
-    }
+  /* Output deferred to the end of the batch still takes up the receive window.
+     Deliver it now rather than drop a segment the window has no room for. */
+  if(conn_rx_batch_pending(state->conn) && rcvbuf_ready(&state->rx_buffer) > 0
+    && !rcvbuf_fits(&state->rx_buffer, ntohl(segment->seqno) + len - HDR_CTCP_SEGMENT)){
+    ctcp_output(state);
+  }
 
+  uint32_t fresh = 0;
+  uint32_t ready = rcvbuf_ready(&state->rx_buffer);
+  bool gap = state->rx_buffer.held > ready;
+  if(is_new_data_segment(state, segment)){
+    fresh = rcvbuf_insert(&state->rx_buffer, ntohl(segment->seqno),
+        (uint8_t*)segment->data, len - HDR_CTCP_SEGMENT);
+    _log_info("%u new bytes. Rx buffer holds %u bytes waiting for output / rcvr buffer: %d.\n",
+        fresh, state->rx_buffer.held, state->config.recv_window);
+  }
+  if(fresh == 0){
+    /* A duplicate means the sender missed the ACK for it. Output is acked once
+       for all it covers, so ACK again right away instead of waiting for data
+       that may never come. */
+    _log_info("Data was already received. Drop it and ACK again.\n");
+    send_cumulative_ack(state);
+  }else if(rcvbuf_ready(&state->rx_buffer) == ready){
+    /* Out of order. A duplicate ACK right away tells the sender about the hole. */
+    send_cumulative_ack(state);
   }else{
-    _log_info("Data was already received. Drop it.\n");
-    free(segment);
+    state->gro_segments += 1;
+    state->rx_segments += 1;
+    /* Don't hold the ACK for data that fills (part of) a hole, nor for a short
+       segment, which the sender is unlikely to follow up on soon. */
+    if(gap || len - HDR_CTCP_SEGMENT < MAX_SEG_DATA_SIZE){
+      state->quick_ack = true;
+    }
   }
+  free(segment);
   
-  ctcp_output(state);
+  /* When a batch is being delivered the library calls ctcp_output() once
+     at the end of it, so the in-order segments of a batch go out as one
+     delivery with one cumulative ACK. Past the coalescing limits, deliver
+     early: an ACK covering too much at once skews the sender's delivery-rate
+     samples. */
+  if(!conn_rx_batch_pending(state->conn) || gro_limit_reached(state)){
+    ctcp_output(state);
+  }
 }
 
 void ctcp_output(ctcp_state_t *state) {
-  
-  while(ll_length(state->received_segments) > 0){
-    ll_node_t *node = ll_front(state->received_segments);
-    ctcp_segment_t *rcvd_segment = node->object;
-
-    /* Output segment only if it is in-order.
-     새로 받은 segment랑 이전에 output(ack)했던 segment 사이에 hole이 없을 때만 쭉 output하기.
-    */
-    if(rcvd_segment->seqno != htonl(state->rx_next_output_seqno)){
-      _log_info("Received seqno %d, but seqno %d is waiting for output.\n", ntohl(rcvd_segment->seqno), state->rx_next_output_seqno);
-      break;
-    }
-
-    // Check if STDOUT buffer is available for output.
-    size_t available_bufspace = conn_bufspace(state->conn);
-    size_t rcvd_data_sz = ntohs(rcvd_segment->len) - HDR_CTCP_SEGMENT;
+  struct iovec iov[2];
+  int iovcnt = rcvbuf_readable(&state->rx_buffer, iov);
+  if(iovcnt == 0){
+    return;
+  }
 
-    // If STDOUT buffer available space is enough, output data to STDOUT and send ACK.
-    if(available_bufspace >= rcvd_data_sz){
-      state->rx_next_output_seqno += (ntohs(rcvd_segment->len) - HDR_CTCP_SEGMENT);
-      state->rx_waiting_bytes -= (ntohs(rcvd_segment->len) - HDR_CTCP_SEGMENT);
-      _log_info("Output to STDOUT. Available bufspace: %lu.\n", available_bufspace);
-      _log_info("state->rx_next_output_seqno: %d, state->rx_waiting_bytes: %d. after outputting.\n", state->rx_next_output_seqno, state->rx_waiting_bytes);
-      assert(conn_output(state->conn, rcvd_segment->data, rcvd_data_sz));
+  /* Hand all in-order bytes over at once (one writev). Whatever STDOUT can't
+     take right away is queued in its output buffer as far as there is room. */
+  int output_sz = conn_outputv(state->conn, iov, iovcnt);
+  if(output_sz < 0){
+    _log_info("[ctcp_output] failed to output.\n");
+    return;
+  }
+  if(output_sz == 0){
+    _log_info("[ctcp_output] failed to output since output bufspace is not enough.\n");
+    return;
+  }
 
-      // Send ACK. (Can be piggyback or separate.)
-      // Send ACK only.
-      send_only_ack(state, rcvd_segment);
+  /* Everything output is acked at once. */
+  rcvbuf_consume(&state->rx_buffer, output_sz);
+  state->gro_segments = 0;
+  state->rx_deliveries += 1;
+  state->curr_ackno = state->rx_buffer.start_seqno;
+  _log_info("%d bytes were output. Next seqno waiting for output: %u.\n", output_sz, state->curr_ackno);
+  ack_delivered(state);
+}
 
-      // Remove handled node from linked list(received_segments)
-      ll_remove(state->received_segments, node); // This frees the node.
-      free(rcvd_segment);
-    }
-    else{
-      _log_info("[ctcp_output] failed to output since output bufspace is not enough.\n");
-      break;
-    }
+/**
+  ACK output data now, or hold the ACK back for more (delayed ACK, RFC 1122).
+  Data is acked once ack_rate full segments have built up, capped at half the
+  receive window so the sender never stalls on a held ACK, and otherwise when
+  the delayed ACK timer goes off.
+*/
+void ack_delivered(ctcp_state_t* state){
+  uint32_t unacked = state->curr_ackno - state->acked_seqno;
+  uint32_t threshold = MIN(state->ack_rate * MAX_SEG_DATA_SIZE, state->config.recv_window / 2u);
+  if(state->quick_ack || unacked >= threshold || state->config.ack_delay_us == 0){
+    send_cumulative_ack(state);
+  }else if(state->ack_index == SCHED_NOT_QUEUED){
+    sched_queue(&delayed_acks, state, &state->ack_index,
+        monotonic_current_time_us() + state->config.ack_delay_us);
   }
 }
 
@@ -423,7 +783,7 @@ void ctcp_timer() {
       /* TIME_WAIT or LAST_ACK */
       curr_state->time_wait_in_ms += curr_state->config.timer;
 
-      if((curr_state->time_wait_in_ms > 2 * MSL) || (ll_length(curr_state->segments) == 0)){
+      if((curr_state->time_wait_in_ms > 2 * MSL) || (sndbuf_in_flight(&curr_state->tx_buffer) == 0)){
         /* The host waits for a period of time equal to double the maximum segment life (MSL) time, 
         to ensure the ACK it sent was received.
         Terminate TCP connection if
@@ -438,88 +798,859 @@ void ctcp_timer() {
         curr_state = curr_state->next;
       }
     }else{
-      /* RETRANSMISSION */
-      ll_node_t *curr_node = ll_front(curr_state->segments);
-      int destroyed = 0;
-      while(curr_node){
-        ctcp_transmission_info_t *trans_info = (ctcp_transmission_info_t*)curr_node->object;
-        trans_info->time_elapsed += curr_state->config.timer;
-        
-        if(trans_info->num_of_transmission >= 6 || trans_info->time_elapsed >= 6*(curr_state->config.rt_timeout)){
-          // Tear down if 6th retransmission happens.(segment can be sent up to 6 times in total.)
-          _log_info("Tear down. 6th retransmission was tried to be sent.\n");
-          ctcp_state_t *destroy_state = curr_state;
-          curr_state = curr_state->next;
-          destroyed=1;
-          ctcp_destroy(destroy_state);
-          break;
-        }else if(trans_info->time_elapsed % curr_state->config.rt_timeout == 0){
-          _log_info("[RETRANSMIT] Transmit %d-th time.\n", trans_info->num_of_transmission);
-          // Retransmit if it took retransmission timeout.
-          ctcp_segment_t *segment = &(trans_info->segment);
-          // update segment's acknowledgement number because it could change while waiting for retransmission.
-          segment->ackno = htonl(curr_state->curr_ackno);
-          segment->cksum = 0;
-          segment->cksum = cksum(segment, htons(segment->len)); // update checksum since segment's ackno might be changed.
-          int sent = conn_send(curr_state->conn, segment, ntohs(segment->len));
-          if(sent == 0){
-            _log_info("[Tx] Nothing was sent.\n");
-          }else if(sent==-1){
-            _log_info("[Tx] Error occured while conn_send for retransmission.\n");
-          }
-          trans_info->num_of_transmission += 1;
-        }
-
-        curr_node = curr_node->next;
-      }
-      if(!destroyed){curr_state = curr_state->next;}
+      /* Retransmission timeouts are timed per connection, see
+         retransmission_timeout(). */
+      curr_state = curr_state->next;
     }
   }
 }
 
 void ctcp_pacing_timer(){
-  if(!state_list){
-    /* If NO connection state, do nothing. */
-    return;
+  uint64_t now_us = monotonic_current_time_us();
+  ctcp_state_t *curr_state = NULL;
+  int64_t sent;
+  int c;
+  refill_credit(&total_bucket.credit, &total_bucket.refill_us, total_bucket.rate,
+      shaper_quantum(), now_us);
+
+  /* Serve the connections that are due, earliest departure first, control class
+     before bulk. Each gets one turn and is queued again at its next departure
+     time, behind connections due at the same time, so ready connections take
+     turns however many there are. Nothing is served while the total rate is
+     used up. */
+  int turns = departures[SHAPER_CONTROL].len + departures[SHAPER_BULK].len;
+  while(turns-- > 0 && (total_bucket.rate == 0 || total_bucket.credit > 0)){
+    for(c = 0; c < SHAPER_CLASSES; c++){
+      if((curr_state = sched_pop(&departures[c], now_us)) != NULL){
+        break;
+      }
+    }
+    if(curr_state == NULL){
+      break;
+    }
+
+    sent = pace_connection(curr_state);
+    if(sent > 0 || (!curr_state->config.txtime && curr_state->pacing_credit <= 0)){
+      schedule_connection(curr_state);
+    }else{
+      /* Nothing went out with credit to spare: cwnd is full or the data is
+         corked. A corked segment is due when the cork expires; otherwise the
+         connection waits for an ACK, a timeout or more input to queue it. */
+      uint32_t unsent = sndbuf_unsent(&curr_state->tx_buffer);
+      uint64_t expiry_us = cork_expiry_us(curr_state, MIN(unsent, MAX_SEG_DATA_SIZE));
+      if(curr_state->lost_bytes == 0 && unsent > 0 && expiry_us > now_us){
+        sched_queue(class_departures(curr_state), curr_state, &curr_state->sched_index, expiry_us);
+      }
+    }
   }
-  
-  ctcp_state_t *curr_state = state_list;
-  /* Go through state_list to send packets if any in tx queues. */
-  while(curr_state){
-    if(curr_state->pacing_rate != 0 
-      && utils_need_timer_in_us(&(curr_state->pacing_last_timeout), curr_state->pacing_gap_us) == 0){
-        send_front_segment_in_tx_buffer(curr_state);
-        clock_gettime(CLOCK_MONOTONIC, &(curr_state->pacing_last_timeout));
+
+  while((curr_state = sched_pop(&delayed_acks, now_us)) != NULL){
+    send_cumulative_ack(curr_state);
+  }
+  while((curr_state = sched_pop(&loss_timers, now_us)) != NULL){
+    ctcp_loss_timer(curr_state, now_us);
+  }
+}
+
+uint64_t ctcp_next_departure_us(){
+  uint64_t departure_us = 0;
+  int c;
+  for(c = 0; c < SHAPER_CLASSES; c++){
+    uint64_t next_us = sched_next_us(&departures[c]);
+    if(next_us && (departure_us == 0 || next_us < departure_us)){
+      departure_us = next_us;
     }
-    curr_state = curr_state->next;
   }
+  /* While the total rate is used up, nobody departs before it is repaid. */
+  if(departure_us && total_bucket.rate){
+    departure_us = MAX(departure_us, credit_eligible_us(total_bucket.credit,
+        total_bucket.refill_us, total_bucket.rate, departure_us));
+  }
+  uint64_t ack_us = sched_next_us(&delayed_acks);
+  if(ack_us && (departure_us == 0 || ack_us < departure_us)){
+    departure_us = ack_us;
+  }
+  uint64_t loss_us = sched_next_us(&loss_timers);
+  if(loss_us && (departure_us == 0 || loss_us < departure_us)){
+    departure_us = loss_us;
+  }
+  return departure_us;
 }
 
-ctcp_transmission_info_t* create_segment(ctcp_state_t *state,
-  uint8_t flags, size_t data_sz, uint8_t data[]){
-  size_t segment_total_sz = HDR_CTCP_SEGMENT + data_sz;
-  ctcp_transmission_info_t *trans_info = (ctcp_transmission_info_t *)malloc(sizeof(ctcp_transmission_info_t) + segment_total_sz);
-  trans_info->time_elapsed = 0;
-  trans_info->num_of_transmission = 0;
-  trans_info->send_time_us = 0;
-  trans_info->ack_time_us = 0;
-  trans_info->rs = NULL;
-  
+/**
+  returns the departure scheduler of the connection's shaper class.
+*/
+ctcp_sched_t* class_departures(ctcp_state_t* state){
+  return &departures[state->config.priority ? SHAPER_CONTROL : SHAPER_BULK];
+}
 
-  ctcp_segment_t *segment = &(trans_info->segment);
-  segment->seqno = htonl(state->curr_seqno);
+/**
+  Queue the connection in the departure scheduler at the time it may send next,
+  or take it off while it has nothing to send. Called whenever it may have
+  something new to send: input was read, an ACK opened cwnd or a segment timed out.
+*/
+void schedule_connection(ctcp_state_t* state){
+  uint64_t departure_us = 0;
+  if(state->lost_bytes > 0 || sndbuf_unsent(&state->tx_buffer) > 0){
+    departure_us = pacing_eligible_us(state);
+  }else{
+    mark_app_limited(state);
+  }
+
+  if(departure_us){
+    sched_queue(class_departures(state), state, &state->sched_index, departure_us);
+  }else{
+    sched_remove(class_departures(state), &state->sched_index);
+    state->shaper_deficit = 0;
+  }
+}
+
+/**
+  When the connection's token bucket has credit again. With SO_TXTIME the qdisc
+  paces, so now.
+  returns the time, 0 if there is no pacing rate to send at yet.
+*/
+uint64_t pacing_eligible_us(ctcp_state_t* state){
+  uint64_t now_us = monotonic_current_time_us();
+  if(state->config.txtime){
+    return now_us;
+  }
+  if(state->pacing_rate == 0){
+    return 0;
+  }
+  return credit_eligible_us(state->pacing_credit, state->pacing_refill_us,
+      state->pacing_rate, now_us);
+}
+
+/**
+  Add the credit a token bucket has earned at rate since it was last refilled, up
+  to max_bytes. Credit is in bytes scaled by USEC_PER_SEC, so that credit for
+  fractions of a byte is kept.
+*/
+void refill_credit(int64_t* credit, uint64_t* refill_us, uint64_t rate, uint32_t max_bytes, uint64_t now_us){
+  *credit += (int64_t)((now_us - *refill_us) * rate);
+  *credit = MIN(*credit, (int64_t)max_bytes * USEC_PER_SEC);
+  *refill_us = now_us;
+}
+
+/**
+  returns when a token bucket has credit again: now_us if it has some left,
+  otherwise once rate has repaid the overdraft.
+*/
+uint64_t credit_eligible_us(int64_t credit, uint64_t refill_us, uint64_t rate, uint64_t now_us){
+  if(credit > 0){
+    return now_us;
+  }
+  return MAX(refill_us + (uint64_t)(-credit) / rate + 1, now_us);
+}
+
+/**
+  Bytes one pacer wakeup may release, autosized from the pacing rate.
+*/
+uint32_t pacing_quantum(ctcp_state_t* state){
+  uint64_t quantum = state->pacing_rate >> PACING_QUANTUM_SHIFT;
+  return MIN(MAX(quantum, PACING_MIN_QUANTUM), PACING_MAX_QUANTUM);
+}
+
+/**
+  Bytes one unit of weight entitles a connection to per turn while the total
+  rate is shared, autosized from the total rate like the pacing quantum. It is
+  also the most credit the total bucket holds.
+*/
+uint32_t shaper_quantum(){
+  uint64_t quantum = total_bucket.rate >> PACING_QUANTUM_SHIFT;
+  return MIN(MAX(quantum, PACING_MIN_QUANTUM), PACING_MAX_QUANTUM);
+}
+
+/**
+  Token-bucket pacer. Credit accrues at pacing_rate, up to one quantum, and each
+  segment sent spends its actual length, so a wakeup releases a quantum of
+  several segments at high rates instead of needing a wakeup per segment.
+  A segment may overdraw the credit; the next one waits until it is repaid.
+  With SO_TXTIME the qdisc enforces departure times instead, so everything cwnd
+  allows is handed over.
+  Under a total rate, a turn also ends once the connection has sent its share of
+  weight shaper quanta (deficit round-robin). Every byte spends total credit too
+  and may overdraw it, so a heavier connection sends its whole share in its turn;
+  no turn starts until the overdraft is repaid. A share cut short by the pacing
+  credit is finished in the next turn.
+  returns the data bytes sent.
+*/
+int64_t pace_connection(ctcp_state_t* state){
+  const bool txtime = state->config.txtime;
+  const uint32_t share = total_bucket.rate ? state->config.weight * shaper_quantum() : 0;
+  if(!txtime){
+    refill_credit(&state->pacing_credit, &state->pacing_refill_us, state->pacing_rate,
+        MAX(pacing_quantum(state), share), monotonic_current_time_us());
+  }
+  if(total_bucket.rate && state->shaper_deficit <= 0){
+    // A new share once the last one is spent. An overdraft carries over.
+    state->shaper_deficit += share;
+  }
+
+  int64_t sent, total = 0;
+  while((txtime || state->pacing_credit > 0)
+    && (total_bucket.rate == 0 || state->shaper_deficit > 0)
+    && (sent = send_front_segment_in_tx_buffer(state)) > 0){
+    if(!txtime){
+      state->pacing_credit -= sent * USEC_PER_SEC;
+    }
+    if(total_bucket.rate){
+      total_bucket.credit -= sent * USEC_PER_SEC;
+      state->shaper_deficit -= sent;
+    }
+    total += sent;
+  }
+  return total;
+}
+
+/**
+  Append data to the Tx buffer as not yet sent bytes. The segment carrying them
+  is cut when they are sent.
+*/
+void create_segment(ctcp_state_t *state, size_t data_sz, uint8_t data[]){
+  sndbuf_append(&state->tx_buffer, data, data_sz);
   state->curr_seqno += data_sz; // Update sequence number.
+}
+
+/**
+  Retransmission collapse (like tcp_retrans_try_collapse): before segment i is
+  retransmitted, merge the unacked data segments that follow it into it, up to
+  MSS, so recovery takes fewer packets and pacing slots. The merged segment has
+  been transmitted as often as its most transmitted piece, so the teardown limit
+  still holds for every byte.
+  returns the number of segments merged in.
+*/
+int collapse_retransmit(ctcp_state_t* state, uint32_t i){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, i);
+  int merged = 0;
+  if(trans_info->segment.flags != TH_ACK){
+    return 0;
+  }
+  while(i + 1 != tx_buffer->next){
+    ctcp_transmission_info_t *next_info = sndbuf_desc(tx_buffer, i + 1);
+    uint16_t data_sz = ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+    uint16_t next_sz = ntohs(next_info->segment.len) - HDR_CTCP_SEGMENT;
+    if(next_info->segment.flags != TH_ACK || next_info->sacked || data_sz + next_sz > MAX_SEG_DATA_SIZE){
+      break;
+    }
+    trans_info->num_of_transmission = MAX(trans_info->num_of_transmission, next_info->num_of_transmission);
+    if(trans_info->retrans_pending && !next_info->retrans_pending){
+      state->lost_bytes += next_sz; // It is retransmitted as part of segment i.
+    }
+    bbr_free_rate_sample(next_info->rs);
+    sndbuf_merge_next(tx_buffer, i);
+    merged++;
+  }
+  if(merged){
+    _log_info("[RETRANSMIT] Collapsed %d segments into a %d-byte retransmission.\n",
+        merged + 1, (int)(ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT));
+  }
+  return merged;
+}
+
+/**
+  Build a segment from its descriptor and the bytes in the Tx buffer, stamp it with
+  the up-to-date ackno, window and checksum, and send it.
+  departure_us: Earliest departure time for SO_TXTIME, 0 to send right away.
+  returns what conn_send returns.
+*/
+int transmit_segment(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint64_t departure_us){
+  uint8_t buf[sizeof(ctcp_segment_t) + MAX_SEG_DATA_SIZE];
+  ctcp_segment_t *segment = (ctcp_segment_t*)buf;
+  uint16_t len = sndbuf_build_segment(&state->tx_buffer, trans_info, segment);
   segment->ackno = htonl(state->curr_ackno);
-  segment->len = htons(segment_total_sz);
-  segment->flags = flags; // Network byte order
   segment->window = htons(state->config.recv_window); // Advertise the size of bytes that can be received from sender.
   segment->cksum = 0;
-  memcpy(segment->data, data, data_sz);
+  segment->cksum = cksum(segment, len); // cksum function returns network byte order
+  print_hdr_ctcp(segment);
+  ctcp_options_t options = {
+    .ack_rate = ack_rate_request(state),
+    .timestamps = state->config.timestamps,
+    .ts_val = (uint32_t)trans_info->xmit_time_us,
+    .ts_ecr = state->ts_recent,
+  };
+  return conn_send_options(state->conn, segment, len, departure_us, &options);
+}
 
-  // Calculate cksum
-  segment->cksum = cksum(segment, segment_total_sz); // cksum function returns network byte order
+/**
+  returns the ACK rate to ask the receiver for, in full segments per ACK. A
+  fraction of cwnd, so the receiver acks a few times per RTT however fast the
+  packets come (as in the ACK frequency draft). 0, for no request, unless the
+  receiver offered ACK rate requests in the handshake.
+*/
+uint8_t ack_rate_request(ctcp_state_t* state){
+  if(!state->config.ack_rate){
+    return 0;
+  }
+  uint32_t rate = MIN(state->cwnd / ACKS_PER_CWND, state->config.ack_frequency);
+  return MAX(1, MIN(rate, UINT8_MAX));
+}
 
-  return trans_info;
+/**
+  Release in-flight segments that are cumulatively acked by ackno (host order),
+  oldest first. Only as many descriptors are visited as are acked. An ackno that
+  ends inside a segment (it was collapsed after the receiver got part of it)
+  releases the acked part and leaves the rest in flight.
+  update_model: Hand each acked segment to BBR. Only data segments are released then,
+                the FIN is released by the termination handshake.
+  returns the number of segments released.
+*/
+int release_acked_segments(ctcp_state_t* state, uint32_t ackno, uint64_t ack_time_us, bool update_model){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  int released = 0;
+  uint32_t trimmed = 0;
+  while(sndbuf_in_flight(tx_buffer) > 0){
+    ctcp_transmission_info_t *curr_trans_info = sndbuf_desc(tx_buffer, tx_buffer->head);
+    ctcp_segment_t *curr_segment = &(curr_trans_info->segment);
+    if(ntohl(curr_segment->seqno) >= ackno || (update_model && !(curr_segment->flags & TH_ACK))){
+      break;
+    }
+    uint16_t size_of_acked_segments = (ntohs(curr_segment->len) - HDR_CTCP_SEGMENT);
+    if(ntohl(curr_segment->seqno) + size_of_acked_segments > ackno){
+      trimmed = ackno - ntohl(curr_segment->seqno);
+      _log_info("%u bytes of a %d-byte segment were acked.\n", trimmed, size_of_acked_segments);
+      state->tx_in_flight_bytes -= trimmed;
+      if(curr_trans_info->retrans_pending){
+        state->lost_bytes -= trimmed;
+      }
+      if(curr_trans_info->sacked){
+        state->sacked_bytes -= trimmed;
+      }
+      sndbuf_trim_head(tx_buffer, trimmed);
+      break;
+    }
+    _log_info("%d bytes of segment data was acked. tx_in_flight_bytes %d->%d.\n", size_of_acked_segments,
+      state->tx_in_flight_bytes, state->tx_in_flight_bytes - size_of_acked_segments);
+    state->tx_in_flight_bytes -= size_of_acked_segments;
+    if(curr_trans_info->retrans_pending){
+      state->lost_bytes -= size_of_acked_segments;
+    }
+    if(curr_trans_info->sacked){
+      // Already handed to BBR when it was SACKed.
+      state->sacked_bytes -= size_of_acked_segments;
+    }else if(update_model){
+      // Kernel timestamp can't precede our send, but clock conversion jitter might say so.
+      curr_trans_info->ack_time_us = MAX(ack_time_us, curr_trans_info->send_time_us);
+      update_rtt(state, curr_trans_info, curr_trans_info->ack_time_us);
+      rack_update(state, curr_trans_info, ack_time_us);
+      if(state->bbr_model) {
+        state->bbr_model->on_ack(state, curr_trans_info);
+      }
+    }else{
+      bbr_free_rate_sample(curr_trans_info->rs);
+    }
+    curr_trans_info->rs = NULL;
+    sndbuf_release_head(tx_buffer);
+    released++;
+  }
+  if(released || trimmed){
+    // New data was acked: restart the retransmission timer, or stop it.
+    rto_arm(state, monotonic_current_time_us());
+    update_input_throttle(state);
+    schedule_connection(state);
+  }
+  return released;
+}
+
+/**
+  SACK scoreboard (RFC 6675). Segments covered by the SACK blocks of an ACK are
+  delivered: BBR counts them now, they leave the pipe and are never
+  retransmitted. The segments SACK then shows to be lost are queued for
+  retransmission right away, so only the holes are resent.
+  returns the number of segments newly SACKed.
+*/
+int update_scoreboard(ctcp_state_t* state, const ctcp_options_t* options, uint64_t ack_time_us){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  int b, sacked = 0;
+  for(b = 0; b < options->num_sacks; b++){
+    const ctcp_sack_block_t *block = &options->sacks[b];
+    uint32_t i;
+    for(i = sndbuf_find(tx_buffer, block->start); i != tx_buffer->next; i++){
+      ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, i);
+      uint32_t seqno = ntohl(trans_info->segment.seqno);
+      uint32_t data_sz = ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+      if(seqno + data_sz > block->end){
+        break;
+      }
+      if(trans_info->sacked || seqno < block->start || trans_info->segment.flags != TH_ACK){
+        continue;
+      }
+      trans_info->sacked = true;
+      state->sacked_bytes += data_sz;
+      if(trans_info->retrans_pending){
+        trans_info->retrans_pending = false;
+        state->lost_bytes -= data_sz;
+      }
+      trans_info->ack_time_us = MAX(ack_time_us, trans_info->send_time_us);
+      update_rtt(state, trans_info, trans_info->ack_time_us);
+      rack_update(state, trans_info, ack_time_us);
+      if(state->bbr_model){
+        state->bbr_model->on_ack(state, trans_info);
+      }else{
+        bbr_free_rate_sample(trans_info->rs);
+      }
+      trans_info->rs = NULL;
+      sacked++;
+    }
+  }
+  if(sacked){
+    state->sacked_segments += sacked;
+    if(!state->config.rack){
+      mark_lost_by_sack(state);
+    }
+    schedule_connection(state);
+  }
+  return sacked;
+}
+
+/**
+  Take as lost every segment with at least SACK_DUPTHRESH segments' worth of
+  SACKed data after it (IsLost, RFC 6675), and queue it for retransmission ahead
+  of new data. A segment is taken as lost by SACK only once; if its
+  retransmission is lost too, the timeout finds it.
+  returns the number of segments taken as lost.
+*/
+int mark_lost_by_sack(ctcp_state_t* state){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  uint32_t sacked_above = 0;
+  int lost = 0;
+  uint32_t i = tx_buffer->next;
+  while(i != tx_buffer->head){
+    ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, --i);
+    uint32_t data_sz = ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+    if(trans_info->sacked){
+      sacked_above += data_sz;
+    }else if(sacked_above >= SACK_DUPTHRESH * MAX_SEG_DATA_SIZE && !trans_info->sack_lost
+      && !trans_info->retrans_pending && trans_info->segment.flags == TH_ACK){
+      _log_info("[SACK] Segment %u is lost. Queue it for retransmission.\n", ntohl(trans_info->segment.seqno));
+      trans_info->sack_lost = true;
+      trans_info->retrans_pending = true;
+      state->lost_bytes += data_sz;
+      lost++;
+    }
+  }
+  if(lost){
+    recovery_begin(state, false);
+  }
+  state->sack_lost_segments += lost;
+  return lost;
+}
+
+/**
+  returns the bytes in flight in the network (pipe, RFC 6675): sent and not acked,
+  leaving out what was SACKed or is waiting to be retransmitted.
+*/
+uint32_t pipe_bytes(ctcp_state_t* state){
+  return state->tx_in_flight_bytes - state->lost_bytes - state->sacked_bytes;
+}
+
+/**
+  Take the RTT of a delivered segment, the same sample BBR takes, into the
+  RTO estimator. Karn's rule: a retransmitted segment gives no sample, since it
+  can't tell which transmission was acked, and the backed-off timeout is kept
+  until a segment that was sent once is acked.
+*/
+void update_rtt(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint64_t ack_time_us){
+  if(trans_info->num_of_transmission > 1){
+    return;
+  }
+  rtt_sample(state, ack_time_us - trans_info->send_time_us);
+}
+
+/**
+  Take an RTT sample into the smoothed RTT and RTT variation, and compute the
+  retransmission timeout from them (RFC 6298). The variation term is at least
+  the loss timer slack plus a delayed ACK, so the RTO stays clear of the PTO:
+    RTO = SRTT + max(4 * RTTVAR, slack + ack_delay), within [rto_min_us, rto_max_us]
+*/
+void rtt_sample(ctcp_state_t* state, uint64_t rtt_us){
+  if(state->srtt_us == 0){
+    state->srtt_us = rtt_us;
+    state->rttvar_us = rtt_us / 2;
+  }else{
+    uint64_t err_us = state->srtt_us > rtt_us ? state->srtt_us - rtt_us : rtt_us - state->srtt_us;
+    state->rttvar_us = state->rttvar_us - (state->rttvar_us >> 2) + (err_us >> 2);
+    state->srtt_us = state->srtt_us - (state->srtt_us >> 3) + (rtt_us >> 3);
+  }
+  if(state->min_rtt_us == 0 || rtt_us < state->min_rtt_us){
+    state->min_rtt_us = rtt_us;
+  }
+  uint64_t var_us = MAX(4 * state->rttvar_us, loss_timer_slack_us(state) + state->config.ack_delay_us);
+  state->rto_us = MIN(MAX(state->srtt_us + var_us,
+      (uint64_t)state->config.rto_min_us), (uint64_t)state->config.rto_max_us);
+  state->rto_backoff = 0;
+}
+
+/**
+  returns the slack loss timers allow beyond the RTT: a quarter of min RTT, but
+  at least LOSS_TIMER_MIN_US.
+*/
+uint64_t loss_timer_slack_us(ctcp_state_t* state){
+  return MAX(state->min_rtt_us >> RACK_REO_WND_SHIFT, (uint64_t)LOSS_TIMER_MIN_US);
+}
+
+/**
+  returns the gap pacing leaves between two full segments. The ACKs of paced
+  data come as far apart, so RACK and the PTO wait that much longer.
+*/
+uint64_t pacing_gap_us(ctcp_state_t* state){
+  if(state->pacing_rate == 0){
+    return 0;
+  }
+  return (uint64_t)MAX_SEG_DATA_SIZE * USEC_PER_SEC / state->pacing_rate;
+}
+
+/**
+  returns when the RTO and PTO start to count: now, or with SO_TXTIME the next
+  paced departure if the qdisc is still holding segments until then.
+*/
+uint64_t loss_timer_base_us(ctcp_state_t* state, uint64_t now_us){
+  return state->config.txtime ? MAX(now_us, state->next_departure_us) : now_us;
+}
+
+/**
+  returns the retransmission timeout with backoff: doubled for every timeout
+  since the last RTT sample, up to rto_max_us.
+*/
+uint64_t current_rto_us(ctcp_state_t* state){
+  return MIN(state->rto_us << state->rto_backoff, MAX(state->rto_us, (uint64_t)state->config.rto_max_us));
+}
+
+/**
+  (Re)start the retransmission timer while data is outstanding that hasn't been
+  SACKed, or stop it.
+*/
+void rto_arm(ctcp_state_t* state, uint64_t now_us){
+  state->rto_timeout_us = 0;
+  if(state->tx_in_flight_bytes > state->sacked_bytes){
+    state->rto_timeout_us = loss_timer_base_us(state, now_us) + current_rto_us(state);
+  }
+  arm_loss_timer(state);
+}
+
+/**
+  The retransmission timer went off (RFC 6298): take everything outstanding
+  that hasn't been SACKed as lost and queue it for retransmission, have BBR cut
+  cwnd to one segment, back the timer off and start it again. After
+  RTO_MAX_BACKOFF timeouts in a row the other host is taken as gone and the
+  connection is torn down.
+  returns whether the connection was torn down.
+*/
+bool retransmission_timeout(ctcp_state_t* state, uint64_t now_us){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  uint32_t i;
+  if(state->rto_backoff + 1 >= RTO_MAX_BACKOFF){
+    _log_info("Tear down after %d retransmission timeouts in a row.\n", RTO_MAX_BACKOFF);
+    ctcp_destroy(state);
+    return true;
+  }
+  _log_info("[RETRANSMIT] Retransmission timeout (%lu us). Queue outstanding segments for retransmission.\n",
+      current_rto_us(state));
+  // Test the first timeout of a recovery with F-RTO; after a later one, retransmit as usual.
+  state->frto = recovery_begin(state, true) && state->config.frto ? FRTO_FIRST_ACK : FRTO_OFF;
+  for(i = tx_buffer->head; i != tx_buffer->next; i++){
+    ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, i);
+    if(trans_info->sacked || trans_info->retrans_pending){
+      continue;
+    }
+    // Queued ahead of new data, it leaves in the next pacing slot cwnd allows.
+    trans_info->retrans_pending = true;
+    state->lost_bytes += ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+  }
+  state->rto_backoff += 1;
+  state->rto_timeouts += 1;
+  rto_arm(state, now_us);
+  schedule_connection(state);
+  return false;
+}
+
+/**
+  RACK (RFC 8985): note a newly delivered segment. The most recently sent of the
+  delivered segments is what the others are timed against. An ACK that comes
+  back sooner than min RTT after a retransmission is for the original and says
+  nothing about when the retransmission was delivered, so it is left out.
+*/
+void rack_update(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint64_t ack_time_us){
+  uint64_t xmit_us = trans_info->xmit_time_us;
+  uint64_t rtt_us = ack_time_us > xmit_us ? ack_time_us - xmit_us : 0;
+  uint32_t end_seqno = ntohl(trans_info->segment.seqno)
+    + ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+  if(trans_info->num_of_transmission > 1 && rtt_us < state->min_rtt_us){
+    return;
+  }
+  if(xmit_us > state->rack_xmit_us
+    || (xmit_us == state->rack_xmit_us && end_seqno > state->rack_end_seqno)){
+    state->rack_xmit_us = xmit_us;
+    state->rack_end_seqno = end_seqno;
+    state->rack_rtt_us = rtt_us;
+  }
+}
+
+/**
+  RACK (RFC 8985): a segment is lost once a segment sent after it has been
+  delivered and it has had an RTT plus the reordering window to be acked
+  itself. The window is the loss timer slack, grown by reo_wnd_mult after
+  spurious retransmissions up to SRTT, plus the pacing gap. Lost segments are
+  queued for retransmission ahead of new data. The reordering timer is armed
+  for those still inside the window.
+  returns the number of segments taken as lost.
+*/
+int rack_detect_loss(ctcp_state_t* state, uint64_t now_us){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  uint64_t slack_us = loss_timer_slack_us(state);
+  uint64_t reo_wnd_us = MIN(slack_us * state->rack_reo_wnd_mult, MAX(state->srtt_us, slack_us))
+    + pacing_gap_us(state);
+  uint64_t timeout_us = 0;
+  int lost = 0;
+  uint32_t i;
+  state->rack_timeout_us = 0;
+  if(state->rack_xmit_us == 0){
+    return 0;
+  }
+  for(i = tx_buffer->head; i != tx_buffer->next; i++){
+    ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, i);
+    uint32_t data_sz = ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+    uint32_t end_seqno = ntohl(trans_info->segment.seqno) + data_sz;
+    // The buffer is in first-send order: past the first segment sent once
+    // after the latest delivered one, everything was sent later still.
+    if(trans_info->num_of_transmission == 1 && trans_info->xmit_time_us > state->rack_xmit_us){
+      break;
+    }
+    if(trans_info->sacked || trans_info->retrans_pending || trans_info->segment.flags != TH_ACK){
+      continue;
+    }
+    // Only segments sent before the latest delivered one can be behind it.
+    if(trans_info->xmit_time_us > state->rack_xmit_us
+      || (trans_info->xmit_time_us == state->rack_xmit_us && end_seqno >= state->rack_end_seqno)){
+      continue;
+    }
+    uint64_t deadline_us = trans_info->xmit_time_us + state->rack_rtt_us + reo_wnd_us;
+    if(deadline_us <= now_us){
+      _log_info("[RACK] Segment %u is lost. Queue it for retransmission.\n", ntohl(trans_info->segment.seqno));
+      trans_info->retrans_pending = true;
+      state->lost_bytes += data_sz;
+      lost++;
+    }else{
+      timeout_us = MAX(timeout_us, deadline_us);
+    }
+  }
+  state->rack_timeout_us = timeout_us;
+  arm_loss_timer(state);
+  if(lost){
+    recovery_begin(state, false);
+    state->rack_lost_segments += lost;
+    schedule_connection(state);
+  }
+  return lost;
+}
+
+/**
+  Tail loss probe (RFC 8985): arm the probe timeout (PTO) while data is in
+  flight and nothing is being recovered. The PTO is two smoothed RTTs plus the
+  loss timer slack and the pacing gap, plus room for a delayed ACK when fewer
+  segments are out than the receiver acks at once, and never longer than the
+  retransmission timeout. One probe at a time.
+*/
+void tlp_arm(ctcp_state_t* state, uint64_t now_us){
+  uint64_t rto_us = current_rto_us(state);
+  uint64_t pto_us = rto_us;
+  state->tlp_timeout_us = 0;
+  if(state->config.rack && state->lost_bytes == 0 && state->tlp_end_seqno == 0
+    && state->tx_in_flight_bytes > state->sacked_bytes){
+    if(state->srtt_us){
+      pto_us = 2 * state->srtt_us + loss_timer_slack_us(state) + pacing_gap_us(state);
+      if(sndbuf_in_flight(&state->tx_buffer) < MAX(2, ack_rate_request(state))){
+        pto_us += state->config.ack_delay_us;
+      }
+      pto_us = MIN(pto_us, rto_us);
+    }
+    state->tlp_timeout_us = loss_timer_base_us(state, now_us) + pto_us;
+  }
+  arm_loss_timer(state);
+}
+
+/**
+  Send the tail loss probe: retransmit the last segment that is neither SACKed
+  nor waiting for retransmission, so that its ACK (with SACK) shows whatever
+  was lost at the tail of the flight and RACK can recover it instead of a
+  timeout. New data would do as well, but when the PTO goes off cwnd or the
+  application has held it back.
+*/
+void tlp_send_probe(ctcp_state_t* state){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  uint32_t i = tx_buffer->next;
+  while(i != tx_buffer->head){
+    ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, --i);
+    if(trans_info->sacked || trans_info->retrans_pending || trans_info->segment.flags != TH_ACK){
+      continue;
+    }
+    uint32_t data_sz = ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+    _log_info("[TLP] Probe with segment %u.\n", ntohl(trans_info->segment.seqno));
+    trans_info->retrans_pending = true;
+    state->lost_bytes += data_sz;
+    state->tlp_end_seqno = ntohl(trans_info->segment.seqno) + data_sz;
+    state->tlp_probes += 1;
+    schedule_connection(state);
+    return;
+  }
+}
+
+/**
+  Queue the connection in the loss timer scheduler at the earliest of its
+  retransmission timer, RACK reordering timer and PTO, or take it off if none
+  is armed.
+*/
+void arm_loss_timer(ctcp_state_t* state){
+  uint64_t due_us = state->rto_timeout_us;
+  if(state->rack_timeout_us && (due_us == 0 || state->rack_timeout_us < due_us)){
+    due_us = state->rack_timeout_us;
+  }
+  if(state->tlp_timeout_us && (due_us == 0 || state->tlp_timeout_us < due_us)){
+    due_us = state->tlp_timeout_us;
+  }
+  if(due_us){
+    sched_queue(&loss_timers, state, &state->loss_index, due_us);
+  }else{
+    sched_remove(&loss_timers, &state->loss_index);
+  }
+}
+
+/**
+  A loss timer went off: retransmit on a retransmission timeout, check the
+  segments that were inside the reordering window again, and send the tail loss
+  probe if it is due.
+*/
+void ctcp_loss_timer(ctcp_state_t* state, uint64_t now_us){
+  if(state->rto_timeout_us && state->rto_timeout_us <= now_us
+    && retransmission_timeout(state, now_us)){
+    return;
+  }
+  if(state->rack_timeout_us && state->rack_timeout_us <= now_us){
+    rack_detect_loss(state, now_us);
+  }
+  if(state->tlp_timeout_us && state->tlp_timeout_us <= now_us){
+    state->tlp_timeout_us = 0;
+    if(state->lost_bytes == 0){
+      tlp_send_probe(state);
+    }
+  }
+  arm_loss_timer(state);
+}
+
+/**
+  Segments were taken as lost. BBR cuts cwnd through its loss hook, for a
+  timeout even when a recovery is under way. A new recovery notes the RTO
+  backoff from before it, to restore it, and BBR's cwnd, should every
+  retransmission of the recovery turn out to have been unneeded.
+  timeout: The retransmission timer went off (rather than SACK or RACK).
+  returns whether a new recovery started (false if one is under way).
+*/
+bool recovery_begin(ctcp_state_t* state, bool timeout){
+  bool started = state->undo_recover == 0;
+  if(state->bbr_model && (started || timeout)){
+    state->bbr_model->on_loss(state, timeout);
+  }
+  if(!started){
+    return false;
+  }
+  state->undo_recover = state->tx_buffer.next_seqno;
+  state->undo_end_seqno = 0;
+  state->undo_lost = false;
+  state->undo_backoff = state->rto_backoff;
+  return true;
+}
+
+/**
+  Look at an ACK, before it releases anything, for signs that the recovery under
+  way was spurious: the original segments had arrived, or were about to, and
+  the retransmissions were not needed (a delayed ACK, reordering).
+  - Eifel (RFC 3522): the ACK for the first retransmission echoes the timestamp
+    of an earlier transmission, so the original got there.
+  - F-RTO (RFC 5682), after a timeout: once the first ACK has acked the
+    retransmission, two new segments go out instead of more retransmissions.
+    If the next ACK acks more data, it was data sent only once, so the timeout
+    was spurious. A duplicate ACK at either step means a real loss.
+  The recovery ends once everything outstanding at its start has been acked.
+*/
+void detect_spurious_retransmission(ctcp_state_t* state, uint32_t ackno, const ctcp_options_t* options){
+  bool advanced = ackno > state->tx_buffer.start_seqno;
+  if(state->undo_recover == 0){
+    return;
+  }
+
+  if(state->frto == FRTO_FIRST_ACK){
+    if(advanced && ackno < state->undo_recover && sndbuf_unsent(&state->tx_buffer) > 0){
+      state->frto = FRTO_SECOND_ACK;
+      state->frto_new_segments = 0;
+    }else{
+      state->frto = FRTO_OFF;
+      schedule_connection(state);
+    }
+  }else if(state->frto == FRTO_SECOND_ACK){
+    if(advanced && !state->undo_lost){
+      _log_info("[UNDO] F-RTO: the timeout was spurious.\n");
+      state->spurious_frto += 1;
+      undo_recovery(state, ackno, false);
+      return;
+    }
+    state->frto = FRTO_OFF;
+    schedule_connection(state);
+  }
+
+  if(state->config.timestamps && options->timestamps && state->undo_end_seqno
+    && ackno >= state->undo_end_seqno && !state->undo_lost){
+    if(TS_BEFORE(options->ts_ecr, state->undo_tsval)){
+      _log_info("[UNDO] Eifel: segment %u had arrived before it was retransmitted.\n", state->undo_end_seqno);
+      state->spurious_eifel += 1;
+      undo_recovery(state, ackno, true);
+      return;
+    }
+    state->undo_lost = true;
+  }
+
+  if(ackno >= state->undo_recover){
+    state->undo_recover = 0;
+    state->frto = FRTO_OFF;
+    if(state->bbr_model){
+      state->bbr_model->on_recovery_end(state);
+    }
+  }
+}
+
+/**
+  The recovery was spurious: drop the retransmissions still queued, restore the
+  RTO backoff from before it, have BBR undo its cwnd cut, and widen the RACK
+  reordering window, since it took reordering or delay for loss.
+  eifel: The ACK was for the original transmissions of what it acks, so their
+         retransmissions don't count (for Karn's rule and BBR's samples).
+*/
+void undo_recovery(ctcp_state_t* state, uint32_t ackno, bool eifel){
+  ctcp_send_buffer_t *tx_buffer = &state->tx_buffer;
+  uint32_t i;
+  for(i = tx_buffer->head; i != tx_buffer->next; i++){
+    ctcp_transmission_info_t *trans_info = sndbuf_desc(tx_buffer, i);
+    uint32_t data_sz = ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT;
+    if(trans_info->retrans_pending){
+      trans_info->retrans_pending = false;
+      state->lost_bytes -= data_sz;
+    }
+    if(eifel && ntohl(trans_info->segment.seqno) + data_sz <= ackno
+      && trans_info->num_of_transmission > 1){
+      trans_info->num_of_transmission -= 1;
+    }
+  }
+  state->rto_backoff = state->undo_backoff;
+  if(state->bbr_model){
+    state->bbr_model->on_undo(state);
+  }
+  state->rack_reo_wnd_mult += 1;
+  state->undo_recover = 0;
+  state->undo_end_seqno = 0;
+  state->frto = FRTO_OFF;
+  rto_arm(state, monotonic_current_time_us());
+  schedule_connection(state);
 }
 
 int is_cksum_valid(ctcp_segment_t* segment, size_t len){
@@ -536,63 +1667,82 @@ int is_ack(ctcp_state_t* state, ctcp_segment_t* segment){
 
 }
 
-/* Send the given segment without pacing.
+/* Cut a segment with the given flags from the unsent bytes and send it without pacing.
   FIN segment has data_len of 1, but actually it has no data.
   Also, FIN segment is sent in termination process which means no inflight/pending segments,
   so it can be sent right away without pacing.
 */
-void send_segment(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, size_t data_len){
-  
-
-  /* Send only if the other(receiver)'s buf is available. Otherwise, store segments in waiting_segments.*/
-  ctcp_segment_t *segment = &trans_info->segment;
-  if((state->tx_in_flight_bytes + data_len) <= state->config.send_window){
-    state->tx_in_flight_bytes += data_len;
-    trans_info->num_of_transmission += 1; // When 7, terminate??
-    // update segment's acknowledgement number because this host could ack received segments while transmitting.
-    segment->ackno = htonl(state->curr_ackno);
-    segment->cksum = 0;
-    segment->cksum = cksum(segment, htons(segment->len)); // update checksum since segment's ackno might be changed.
-    ll_add(state->segments, trans_info);
+void send_segment(ctcp_state_t* state, uint8_t flags, size_t data_len){
+  ctcp_transmission_info_t *trans_info = sndbuf_cut(&state->tx_buffer, flags, data_len);
+  state->tx_in_flight_bytes += data_len;
+  trans_info->num_of_transmission += 1;
+  trans_info->xmit_time_us = monotonic_current_time_us();
+  /* Send only if the other(receiver)'s buf is available. Otherwise, the
+     retransmission timer sends it. */
+  if(state->tx_in_flight_bytes <= state->config.send_window){
     /* Send it to the connection associated with the passed in state */
     _log_info("[TX] Sent segment.\n");
-    print_hdr_ctcp(segment);
-    int sent = conn_send(state->conn, segment, data_len + HDR_CTCP_SEGMENT);
+    int sent = transmit_segment(state, trans_info, 0);
     if(sent == 0){
       _log_info("[Tx] Nothing was sent.\n");
     }else if(sent==-1){
       _log_info("[Tx] Error occured while conn_send.\n");
     }
   }
+  if(state->rto_timeout_us == 0){
+    rto_arm(state, monotonic_current_time_us());
+  }
 }
 
 int is_new_data_segment(ctcp_state_t *state, ctcp_segment_t *segment){
-  /* returns: Check if segment is newly received and it has data(not only header). 
+  /* returns: Check if segment has data(not only header) that is newly received.
+   A collapsed retransmission can start before curr_ackno and still carry new data.
    FYI, FIN segment also can be data segment because it is considered as 1-byte segment.*/
-  return (state->curr_ackno <= ntohl(segment->seqno)) && (ntohs(segment->len) > HDR_CTCP_SEGMENT);
+  uint32_t data_sz = ntohs(segment->len) - HDR_CTCP_SEGMENT;
+  return (state->curr_ackno < ntohl(segment->seqno) + data_sz) && (data_sz > 0);
 }
 
 void send_only_ack(ctcp_state_t* state, ctcp_segment_t* rcvd_segment){
-  /* ACK segment's data size is 0. So, it can be directly sent to the other host 
-  no matter how much space the receiver buffer has. */
   assert(state->curr_ackno == ntohl(rcvd_segment->seqno));
-  uint32_t new_ackno = ntohl(rcvd_segment->seqno) + (ntohs(rcvd_segment->len) - HDR_CTCP_SEGMENT);
-  state->curr_ackno = new_ackno;
-  rcvd_segment->seqno = htonl(state->curr_seqno);
-  rcvd_segment->ackno = htonl(state->curr_ackno);
-  rcvd_segment->len = htons(HDR_CTCP_SEGMENT);
-  rcvd_segment->flags = TH_ACK;
-  rcvd_segment->window = htons(state->config.recv_window); // Advertise the size of bytes that can be received from sender.
-  rcvd_segment->cksum = 0;
-  
-  rcvd_segment->cksum = cksum(rcvd_segment, HDR_CTCP_SEGMENT);
-  int sent = conn_send(state->conn, rcvd_segment, HDR_CTCP_SEGMENT);
+  state->curr_ackno = ntohl(rcvd_segment->seqno) + (ntohs(rcvd_segment->len) - HDR_CTCP_SEGMENT);
+  send_cumulative_ack(state);
+}
+
+/**
+  Send an ACK segment for everything up to curr_ackno. ACK segment's data size is 0.
+  So, it can be directly sent to the other host no matter how much space the
+  receiver buffer has.
+*/
+void send_cumulative_ack(ctcp_state_t* state){
+  ctcp_segment_t ack_segment;
+  memset(&ack_segment, 0, sizeof(ack_segment));
+  ack_segment.seqno = htonl(state->curr_seqno);
+  ack_segment.ackno = htonl(state->curr_ackno);
+  ack_segment.len = htons(HDR_CTCP_SEGMENT);
+  ack_segment.flags = TH_ACK;
+  ack_segment.window = htons(state->config.recv_window); // Advertise the size of bytes that can be received from sender.
+  ack_segment.cksum = cksum(&ack_segment, HDR_CTCP_SEGMENT);
+  /* Tell the sender about the blocks received past a hole. */
+  ctcp_options_t options;
+  memset(&options, 0, sizeof(options));
+  if(state->config.sack){
+    options.num_sacks = rcvbuf_sack_blocks(&state->rx_buffer, options.sacks, MAX_SACK_BLOCKS);
+  }
+  if(state->config.timestamps){
+    options.timestamps = true;
+    options.ts_val = (uint32_t)monotonic_current_time_us();
+    options.ts_ecr = state->ts_recent;
+  }
+  state->acked_seqno = state->curr_ackno;
+  state->quick_ack = false;
+  state->acks_sent += 1;
+  sched_remove(&delayed_acks, &state->ack_index);
+  int sent = conn_send_options(state->conn, &ack_segment, HDR_CTCP_SEGMENT, 0, &options);
   if(sent == 0){
     _log_info("[Tx] Nothing was sent.\n");
   }else if(sent==-1){
     _log_info("[Tx] Error occured while conn_send ack.\n");
   }
   _log_info("[Rx] ACK sent.\n");
-  print_hdr_ctcp(rcvd_segment);
-  
-}
\ No newline at end of file
+  print_hdr_ctcp(&ack_segment);
+}
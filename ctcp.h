@@ -13,6 +13,9 @@
 #include "ctcp_sys.h"
 #include "ctcp_linked_list.h"
 #include "ctcp_bbr.h"
+#include "ctcp_send_buffer.h"
+#include "ctcp_recv_buffer.h"
+#include "ctcp_sched.h"
 
 /**
  * Maximum segment data size.
@@ -85,7 +88,49 @@ typedef struct {
                               the OTHER host). For Lab 1 this value
                               will be 1 * MAX_SEG_DATA_SIZE */
   int timer;               /* How often ctcp_timer() is called, in ms. =TIME_INTERVAL */
-  int rt_timeout;          /* Retransmission timeout, in ms. =RT_INTERVAL */
+  int rt_timeout;          /* Retransmission timeout until the RTT has been
+                              measured, in ms. =RT_INTERVAL */
+  uint32_t rto_min_us;     /* Bounds of the retransmission timeout computed
+                              from the RTT. =RTO_MIN_INTERVAL */
+  uint32_t rto_max_us;     /* =RTO_MAX_INTERVAL */
+  uint32_t handshake_rtt_us; /* RTT of the SYN and SYN-ACK, 0 if this host
+                              didn't measure it. The first RTT sample. */
+  bool txtime;             /* Pace by handing departure times to the qdisc
+                              (SO_TXTIME) instead of waking per segment. */
+  bool conn_stats;         /* Report the connection's counters (pacing
+                              accuracy, ACKs, loss recovery) when it closes. */
+  uint32_t notsent_lowat;  /* Stop reading input while this many bytes are
+                              waiting to be sent. 0 derives it from the BDP. */
+  uint32_t autocork_us;    /* Hold a partial segment back for more input for
+                              up to this long while data is in flight. 0 sends
+                              it right away. =AUTOCORK_INTERVAL */
+  uint64_t max_pacing_rate; /* Cap on this connection's pacing rate in bytes/s,
+                               like SO_MAX_PACING_RATE. 0 for no cap. */
+  uint64_t total_rate;     /* Cap on the rate of all connections together in
+                              bytes/s. 0 for no cap. */
+  uint32_t weight;         /* Share of total_rate relative to the other
+                              connections in the same class. =1
+                              --shape sets it per client. */
+  bool priority;           /* Control class: served strictly before the bulk
+                              class whenever it is due. */
+  uint32_t gro_segments;   /* Most in-order segments from one receive batch
+                              coalesced into one delivery and ACK. 0 for the
+                              whole batch, 1 turns coalescing off. */
+  uint32_t gro_bytes;      /* Most in-order bytes coalesced the same way. 0
+                              for no limit. =GRO_MAX_BYTES */
+  uint32_t ack_frequency;  /* Most full segments per ACK, both asked of the
+                              other host and granted to it. 1 acks every
+                              segment. =ACK_FREQUENCY_MAX */
+  bool ack_rate;           /* ACK rate requests: both hosts offered them in
+                              the handshake. */
+  uint32_t ack_delay_us;   /* Longest an ACK is held back. 0 turns delayed
+                              ACKs off. =DELAYED_ACK_INTERVAL */
+  bool sack;               /* Selective acknowledgements: both hosts offered
+                              them in the handshake. */
+  bool rack;               /* RACK-TLP loss detection. =true */
+  bool timestamps;         /* Timestamps: both hosts offered them in the
+                              handshake. */
+  bool frto;               /* F-RTO after retransmission timeouts. =true */
 } ctcp_config_t;
 
 /**
@@ -210,17 +255,30 @@ void ctcp_output(ctcp_state_t *state);
  * should assume the other end of the connection is unresponsive and tear down
  * the connection (via a call to ctcp_destroy()).
  *
+ * Here retransmissions are timed by each connection's retransmission timer
+ * (RFC 6298) instead, and this only closes connections in TIME_WAIT and
+ * LAST_ACK.
+ *
  * Note that this is called BEFORE ctcp_init() so state_list might be NULL.
  */
 void ctcp_timer();
 
-/* Send a segment at pacing rate.
+/* Send segments at pacing rate.
   Called at doloop() in ctcp_sys_internals.c
   Timer for pacing.
-  Send a segment at every interval if there are segments in tx queue 
+  Serves the connections whose departure time has come, earliest first, and
+  sends the delayed ACKs and runs the loss timers that are due.
   */
 void ctcp_pacing_timer();
 
+/* Earliest departure time of any connection waiting to send, or of a delayed ACK
+  or loss timer.
+  Called at doloop() before it blocks, so that it wakes up for ctcp_pacing_timer()
+  in time.
+  returns the departure time in monotonic microseconds, 0 if nothing waits to send.
+  */
+uint64_t ctcp_next_departure_us();
+
 FILE *bbr_data_log_file;
 
 /**
@@ -233,44 +291,56 @@ FILE *bbr_data_log_file;
  */
 typedef struct linked_list linked_list_t;
 typedef struct ctcp_bbr_model ctcp_bbr_model_t;
+
+/**
+ * Pacing accuracy. Only gaps between back-to-back departures of a backlogged
+ * sender are counted, so idle periods do not show up as pacing error.
+ */
+typedef struct {
+  uint64_t last_departure_us; /* Departure time of the previous segment. */
+  bool backlogged;            /* More data was queued behind that segment. */
+  uint64_t gaps;              /* Number of gaps measured. */
+  uint64_t target_sum_us;     /* Sum of target gaps (len / pacing_rate). */
+  uint64_t actual_sum_us;     /* Sum of achieved gaps. */
+  uint64_t abs_err_sum_us;    /* Sum of |achieved - target|. */
+  uint64_t max_err_us;        /* Largest |achieved - target|. */
+  uint64_t segments;          /* Data segments sent. */
+  uint64_t bytes;             /* Data bytes in them. */
+  uint64_t retransmits;       /* Retransmissions sent. */
+  uint64_t retrans_bursts;    /* Runs of retransmissions leaving at once. */
+  uint64_t max_retrans_burst; /* Longest such run. */
+  uint64_t retrans_burst;     /* Length of the current run. */
+  uint64_t last_retrans_us;   /* Departure time of the last retransmission. */
+} ctcp_pacing_stats_t;
+
 struct ctcp_state {
   struct ctcp_state *next;  /* Next in linked list */
   struct ctcp_state **prev; /* Prev in linked list */
 
   conn_t *conn;             /* Connection object -- needed in order to figure
                                out destination when sending */
-  linked_list_t *segments;  /* Linked list of segments sent to this connection.
-                               It may be useful to have multiple linked lists
-                               for unacknowledged segments, segments that
-                               haven't been sent, etc. Lab 1 uses the
-                               stop-and-wait protocol and therefore does not
-                               necessarily need a linked list. You may remove
-                               this if this is the case for you */
-                            /* Consider this segments linked list as sender(transmission) buffer. */
-  
-  linked_list_t *waiting_segments; /* Linked list of segments that was failed to send
-                                      because receiver buffer is not available.
-                                    */
-  linked_list_t *received_segments; /* Receiver buffer. Once segment is received,
-                                      it is stored in received buffer(received_segments).
-                                      If STDOUT buffer is available, it moves to application
-                                      layer and should be removed from received buffer.
-                                      Note that data can be moved to application layer
-                                      only if it is in order.
-                                      This has received segments in its object of each node.
-                                      i.e. stores segments that are received, but not yet 
-                                      processed(output).*/
+  ctcp_send_buffer_t tx_buffer; /* Sender buffer. Holds the unacknowledged byte
+                                   stream, read straight from input, and a
+                                   descriptor per in-flight segment. Bytes
+                                   waiting to be sent (pacing, cwnd) are cut
+                                   into segments when they are sent. */
+
+  ctcp_recv_buffer_t rx_buffer; /* Receiver buffer. Received data is copied to
+                                   its place in the receive window, in order or
+                                   not. Once the bytes before it have arrived and
+                                   STDOUT has room, it moves to the application
+                                   layer and is acked. */
 
   uint32_t curr_seqno; /* current sequence number of in-flight segment */
   uint32_t curr_ackno; /* Last Acked number for the other side. */
-  uint32_t rx_next_output_seqno; /* Sequence number to output next time(=seqno waiting for output). */
 
   uint32_t tx_in_flight_bytes; /* Outstanding bytes(sent but not acknowledged) = inflight bytes. 
                                   When this host is Tx.
                                 */
-  uint32_t rx_waiting_bytes; /* size of data that was received but are waiting for being outputted. 
-                                Since they are not outputted, they are not acked yet.
-                               */
+  uint32_t lost_bytes; /* In-flight bytes that timed out and wait in the send queue
+                          for retransmission. They don't count against cwnd. */
+  uint32_t sacked_bytes; /* In-flight bytes the receiver has selectively acked.
+                            They don't count against cwnd either. */
 
   ctcp_config_t config; /* cTCP configuration struct. */
 
@@ -285,9 +355,87 @@ struct ctcp_state {
 
   /* pacing */
   uint64_t pacing_rate;        /* bandwidth (byte/sec) */
-  uint64_t pacing_gap_us;      /* This means gap(interval) between packets.
-                                 It depends on bbr mode(,so pacing gain). */
-  struct timespec pacing_last_timeout; /* This is for pacing timer. */
+  int64_t pacing_credit;       /* Token bucket: bytes that may be sent now,
+                                  scaled by USEC_PER_SEC so that credit for
+                                  fractions of a byte is kept. Negative while
+                                  the last segment's overdraft is repaid. */
+  uint64_t pacing_refill_us;   /* When credit was last added. */
+  uint64_t next_departure_us;  /* Earliest departure time of the next segment
+                                  when pacing with SO_TXTIME. */
+  int sched_index;             /* Slot in its class's departure scheduler,
+                                  SCHED_NOT_QUEUED while nothing waits to send. */
+  int64_t shaper_deficit;      /* Bytes left of this turn's share of the
+                                  total rate (deficit round-robin). */
+  ctcp_pacing_stats_t pacing_stats; /* Achieved vs target departure gaps. */
+
+  /* autocork */
+  uint64_t unsent_since_us;    /* When the oldest unsent byte was read. */
+  bool corked;                 /* A partial segment is being held back. */
+  uint64_t corked_segments;    /* Partial segments held back for more input. */
+
+  /* receive coalescing */
+  uint32_t gro_segments;       /* In-order segments received since the last
+                                  delivery. */
+  uint64_t rx_segments;        /* In-order segments received. */
+  uint64_t rx_deliveries;      /* Deliveries. */
+
+  /* delayed ACK */
+  uint32_t acked_seqno;        /* ackno of the last ACK sent. */
+  uint32_t ack_rate;           /* Full segments per ACK: what the other host
+                                  asked for, capped by config.ack_frequency. */
+  bool quick_ack;              /* ACK the next delivery right away. */
+  int ack_index;               /* Slot in the delayed ACK scheduler,
+                                  SCHED_NOT_QUEUED while no ACK is held. */
+  uint64_t acks_sent;
+
+  /* SACK */
+  uint64_t sacked_segments;    /* Segments delivered by SACK. */
+  uint64_t sack_lost_segments; /* Segments SACK took as lost. */
+
+  /* RTT and retransmission timeout (RFC 6298) */
+  uint64_t srtt_us;            /* Smoothed RTT, 0 until the first sample. */
+  uint64_t rttvar_us;          /* RTT variation. */
+  uint64_t min_rtt_us;         /* Lowest RTT sample, 0 until the first one. */
+  uint64_t rto_us;             /* Retransmission timeout before backoff. */
+  uint32_t rto_backoff;        /* Timeouts since the last RTT sample. Each
+                                  doubles the timeout. */
+  uint64_t rto_timeout_us;     /* When the retransmission timer goes off, 0 if
+                                  nothing is outstanding. */
+  uint64_t rto_timeouts;
+
+  /* RACK-TLP */
+  uint64_t rack_xmit_us;       /* Latest transmission among the delivered
+                                  segments. */
+  uint32_t rack_end_seqno;     /* End of that segment. Breaks ties. */
+  uint64_t rack_rtt_us;        /* RTT of that segment. */
+  uint64_t rack_timeout_us;    /* When segments still inside the reordering
+                                  window are checked again, 0 if none are. */
+  uint64_t tlp_timeout_us;     /* When the tail loss probe goes out, 0 if it
+                                  isn't armed. */
+  uint32_t tlp_end_seqno;      /* End of the probe while one is unacked, 0
+                                  otherwise. */
+  int loss_index;              /* Slot in the loss timer scheduler,
+                                  SCHED_NOT_QUEUED while no timer is armed. */
+  uint64_t rack_lost_segments; /* Segments RACK took as lost. */
+  uint64_t tlp_probes;         /* Tail loss probes sent. */
+  uint32_t rack_reo_wnd_mult;  /* Reordering window in quarters of min RTT.
+                                  Grows with every spurious retransmission. */
+
+  /* Spurious retransmission detection and undo */
+  uint32_t ts_recent;          /* Timestamp to echo (TS.Recent, RFC 7323). */
+  uint32_t undo_recover;       /* snd_nxt when loss recovery started, 0 when
+                                  not recovering. */
+  uint32_t undo_end_seqno;     /* End of the first segment retransmitted in
+                                  this recovery, 0 until it has gone out. */
+  uint32_t undo_tsval;         /* Its timestamp. */
+  bool undo_lost;              /* A retransmission is known to have been
+                                  needed: nothing to undo. */
+  uint32_t undo_backoff;       /* RTO backoff from before the recovery,
+                                  restored when it turns out to be spurious. */
+  int frto;                    /* F-RTO step (FRTO_*). */
+  uint32_t frto_new_segments;  /* New segments sent in FRTO_SECOND_ACK. */
+  uint64_t spurious_eifel;     /* Recoveries undone on timestamps (Eifel). */
+  uint64_t spurious_frto;      /* Timeouts undone by F-RTO. */
 };
 
 /* LOG */
@@ -308,10 +456,14 @@ struct ctcp_state {
 typedef struct rate_sample ctcp_rs_t;
 
 struct ctcp_transmission_info{
-  uint32_t time_elapsed; /* time elapsed from last transmission of this segment. */
   uint32_t num_of_transmission; /* The number of transmissions of this segment. (not only retransmission) */
   uint64_t send_time_us;  /* time sent in usec. */
+  uint64_t xmit_time_us;  /* time of the latest (re)transmission in usec. */
   uint64_t ack_time_us;  /* time acked in usec. */
+  bool retrans_pending; /* Timed out and waiting for a paced retransmission. */
+  bool sacked;          /* Selectively acked: delivered, never retransmitted. */
+  bool sack_lost;       /* Taken as lost by SACK. Only a timeout makes it lost
+                           again. */
   ctcp_rs_t* rs;
   ctcp_segment_t segment;
 };
@@ -320,16 +472,106 @@ typedef struct ctcp_transmission_info ctcp_transmission_info_t;
 /* Define constant */
 #define HDR_CTCP_SEGMENT sizeof(ctcp_segment_t)
 
-ctcp_transmission_info_t* create_segment(ctcp_state_t *state, uint8_t flags, size_t data_sz, uint8_t data[]);
+void create_segment(ctcp_state_t *state, size_t data_sz, uint8_t data[]);
+int collapse_retransmit(ctcp_state_t* state, uint32_t i);
+int send_retransmission(ctcp_state_t* state);
+uint64_t depart_segment(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint32_t data_sz, uint64_t now_us);
+void record_retransmit(ctcp_state_t* state, uint64_t departure_us);
+int transmit_segment(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint64_t departure_us);
+int release_acked_segments(ctcp_state_t* state, uint32_t ackno, uint64_t ack_time_us, bool update_model);
 int is_cksum_valid(ctcp_segment_t* segment, size_t len);
 int is_ack(ctcp_state_t* state, ctcp_segment_t* segment);
-void send_segment(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, size_t len);
+void send_segment(ctcp_state_t* state, uint8_t flags, size_t len);
 int is_new_data_segment(ctcp_state_t *state, ctcp_segment_t *rcvd_segment);
 void send_only_ack(ctcp_state_t* state, ctcp_segment_t* rcvd_segment);
+void send_cumulative_ack(ctcp_state_t* state);
+void record_departure(ctcp_state_t* state, uint64_t departure_us, uint32_t data_sz);
+uint32_t notsent_lowat(ctcp_state_t* state);
+void update_input_throttle(ctcp_state_t* state);
+bool should_cork(ctcp_state_t* state, uint32_t data_sz);
+uint64_t cork_expiry_us(ctcp_state_t* state, uint32_t data_sz);
+void mark_app_limited(ctcp_state_t* state);
+uint32_t pacing_quantum(ctcp_state_t* state);
+uint32_t shaper_quantum();
+void refill_credit(int64_t* credit, uint64_t* refill_us, uint64_t rate, uint32_t max_bytes, uint64_t now_us);
+uint64_t credit_eligible_us(int64_t credit, uint64_t refill_us, uint64_t rate, uint64_t now_us);
+int64_t pace_connection(ctcp_state_t* state);
+uint64_t pacing_eligible_us(ctcp_state_t* state);
+void schedule_connection(ctcp_state_t* state);
+ctcp_sched_t* class_departures(ctcp_state_t* state);
+void print_conn_stats(ctcp_state_t* state);
+void print_pacing_stats(ctcp_state_t* state);
+bool gro_limit_reached(ctcp_state_t *state);
+void ack_delivered(ctcp_state_t* state);
+int update_scoreboard(ctcp_state_t* state, const ctcp_options_t* options, uint64_t ack_time_us);
+int mark_lost_by_sack(ctcp_state_t* state);
+uint32_t pipe_bytes(ctcp_state_t* state);
+void update_rtt(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint64_t ack_time_us);
+void rtt_sample(ctcp_state_t* state, uint64_t rtt_us);
+uint64_t loss_timer_slack_us(ctcp_state_t* state);
+uint64_t pacing_gap_us(ctcp_state_t* state);
+uint64_t loss_timer_base_us(ctcp_state_t* state, uint64_t now_us);
+uint64_t current_rto_us(ctcp_state_t* state);
+void rto_arm(ctcp_state_t* state, uint64_t now_us);
+bool retransmission_timeout(ctcp_state_t* state, uint64_t now_us);
+void rack_update(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, uint64_t ack_time_us);
+int rack_detect_loss(ctcp_state_t* state, uint64_t now_us);
+void tlp_arm(ctcp_state_t* state, uint64_t now_us);
+void tlp_send_probe(ctcp_state_t* state);
+void arm_loss_timer(ctcp_state_t* state);
+void ctcp_loss_timer(ctcp_state_t* state, uint64_t now_us);
+bool recovery_begin(ctcp_state_t* state, bool timeout);
+void detect_spurious_retransmission(ctcp_state_t* state, uint32_t ackno, const ctcp_options_t* options);
+void undo_recovery(ctcp_state_t* state, uint32_t ackno, bool eifel);
+uint8_t ack_rate_request(ctcp_state_t* state);
 
 #define MAX(x, y) ( x > y ? x:y)
 #define MIN(x, y) ( x < y ? x:y)
 
 #define CTCP_INITIAL_CWND 10
 
+/* ACKs asked for per cwnd of data, so the ACK rate follows the RTT rather than
+   the packet rate. */
+#define ACKS_PER_CWND 4
+
+/* A segment is taken as lost once this many segments' worth of data after it
+   has been SACKed (DupThresh, RFC 6675). */
+#define SACK_DUPTHRESH 3
+
+/* Retransmission timeouts in a row, each with the timeout doubled, before the
+   other host is taken as gone and the connection is torn down. */
+#define RTO_MAX_BACKOFF 6
+
+/* RACK reordering window, as a fraction of min RTT (RFC 8985). */
+#define RACK_REO_WND_SHIFT 2
+
+/* Least slack the RACK reordering window, PTO and RTO allow beyond the RTT, in
+   microseconds. On a path of a few hundred microseconds a quarter of min RTT
+   is less than the jitter the hosts add to ACKs. */
+#define LOSS_TIMER_MIN_US 5000
+
+/* F-RTO steps (RFC 5682): after a timeout and its retransmission, waiting for
+   the first ACK, then sending new data and waiting for the second. */
+#define FRTO_OFF 0
+#define FRTO_FIRST_ACK 1
+#define FRTO_SECOND_ACK 2
+
+/* New segments F-RTO sends to test a timeout. */
+#define FRTO_NEW_SEGMENTS 2
+
+/* Whether 32-bit timestamp a is before b, across wraparound. */
+#define TS_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+/* Pacing quantum: the bytes one pacer wakeup may release. About 1 ms worth at
+   the pacing rate (rate >> 10), like TSO autosizing, within these bounds. */
+#define PACING_QUANTUM_SHIFT 10
+#define PACING_MIN_QUANTUM (2 * MAX_SEG_DATA_SIZE)
+#define PACING_MAX_QUANTUM (64 * 1024)
+
+/* Shaper classes. Each has its own departure scheduler, and the control class
+   is served strictly before the bulk class. */
+#define SHAPER_CONTROL 0
+#define SHAPER_BULK 1
+#define SHAPER_CLASSES 2
+
 #endif /* CTCP_H */
\ No newline at end of file
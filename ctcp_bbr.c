@@ -1,5 +1,6 @@
 #include "ctcp_bbr.h"
 #include "ctcp.h"
+#include "ctcp_pool.h"
 #include "ctcp_utils.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,14 @@
 static uint32_t bbr_full_bw_thresh = BBR_UNIT * 5 / 4;  /* bw up 1.25x per round? */
 static uint32_t bbr_full_bw_cnt    = 3;    /* N rounds w/o bw growth -> pipe full */
 
+/* Rate samples, one per segment in flight. */
+static ctcp_pool_t bbr_rs_pool = POOL_INITIALIZER("rate sample", sizeof(ctcp_rs_t), 64);
+
+void bbr_free_rate_sample(ctcp_rs_t* rs)
+{
+	pool_free(&bbr_rs_pool, rs);
+}
+
 /* Do we estimate that STARTUP filled the pipe? */
 static bool bbr_full_bw_reached(ctcp_bbr_t* bbr)
 {
@@ -38,6 +47,10 @@ static void bbr_update_bw(ctcp_bbr_t* bbr, ctcp_transmission_info_t* trans_info)
 	bbr->delivered_pkts_num += 1;
 	bbr->prior_delivered_time_us = trans_info->ack_time_us;
 
+	/* ACKs with identical receive timestamps give no usable interval. */
+	if (bbr->prior_delivered_time_us <= (int64_t)rs->prior_mstamp)
+		return;
+
 	uint32_t sent_pkts_this_time = bbr->delivered_pkts_num - rs->delivered; // num of packets sent
 	uint32_t delivery_rate = (sent_pkts_this_time << BW_SCALE) / (bbr->prior_delivered_time_us - rs->prior_mstamp); // bw
 
@@ -95,7 +108,7 @@ static uint32_t bbr_target_cwnd(ctcp_bbr_t* bbr, int gain)
 /* 
  * returns BDP in bytes that was calculated by max_bw and min_rtt_us
 */
-static uint64_t bdp_in_bytes(ctcp_bbr_t* bbr, uint32_t gain){
+uint64_t bdp_in_bytes(ctcp_bbr_t* bbr, uint32_t gain){
 	uint32_t bw = bbr_max_bw(bbr); // This is bw based on number of pkts. Should multiply MAX_SEG_DATA_SIZE to present in bytes.
     uint64_t bdp = (uint64_t)bw * bbr->min_rtt_us;
 
@@ -219,6 +232,21 @@ static void bbr_reset_mode(ctcp_bbr_t* bbr)
 	}
 }
 
+/* Segments in the network (pipe): neither acked, SACKed nor taken as lost. */
+static uint32_t bbr_packets_in_flight(ctcp_state_t* state)
+{
+	return (pipe_bytes(state) + MAX_SEG_DATA_SIZE - 1) / MAX_SEG_DATA_SIZE;
+}
+
+/* Note the cwnd to restore when a recovery or BBR_PROBE_RTT ends. */
+static void bbr_save_cwnd(ctcp_state_t* state, ctcp_bbr_t* bbr)
+{
+	if (!bbr->in_recovery && bbr->mode != BBR_PROBE_RTT)
+		bbr->prior_cwnd = state->cwnd;	/* this cwnd is good enough */
+	else  /* loss recovery or BBR_PROBE_RTT have temporarily cut cwnd */
+		bbr->prior_cwnd = MAX(bbr->prior_cwnd, state->cwnd);
+}
+
 /* The goal of PROBE_RTT mode is to have BBR flows cooperatively and
  * periodically drain the bottleneck queue, to converge to measure the true
  * min_rtt (unloaded propagation delay). This allows the flows to keep queues
@@ -265,8 +293,7 @@ static void bbr_update_min_rtt(ctcp_state_t* state, ctcp_bbr_t* bbr, ctcp_transm
 		bbr->mode = BBR_PROBE_RTT;  /* dip, drain queue */
 		bbr->pacing_gain = BBR_UNIT;
 		bbr->cwnd_gain = BBR_UNIT;
-		// bbr_save_cwnd(sk);  /* note cwnd so we can restore it */
-		bbr->prior_cwnd = MAX(bbr->prior_cwnd, state->cwnd); /* note cwnd so we can restore it */
+		bbr_save_cwnd(state, bbr);  /* note cwnd so we can restore it */
 		bbr->probe_rtt_done_stamp_us = 0; /* microsecond(usec) */
 	}
 
@@ -278,7 +305,7 @@ static void bbr_update_min_rtt(ctcp_state_t* state, ctcp_bbr_t* bbr, ctcp_transm
 		
 		/* Maintain min packets in flight for max(200 ms, 1 round). */
 		if (!bbr->probe_rtt_done_stamp_us &&
-		    ll_length(state->segments) <= bbr_cwnd_min_target) {
+		    sndbuf_in_flight(&state->tx_buffer) <= bbr_cwnd_min_target) {
 			bbr->probe_rtt_done_stamp_us = monotonic_current_time_us() + bbr_probe_rtt_mode_ms * 1000;
 			// bbr->probe_rtt_round_done = 0;
 			// bbr->next_rtt_delivered = tp->delivered;
@@ -297,21 +324,43 @@ static void bbr_update_min_rtt(ctcp_state_t* state, ctcp_bbr_t* bbr, ctcp_transm
 	}
 }
 
+/* For the first round of a recovery, send one segment per segment delivered
+ * (packet conservation), so that the flight does not grow while lost segments
+ * are resent. Returns whether cwnd is set by packet conservation.
+ */
+static bool bbr_set_cwnd_to_recover(ctcp_state_t* state, ctcp_bbr_t* bbr,
+				    uint32_t acked, uint32_t* new_cwnd)
+{
+	if (bbr->packet_conservation &&
+	    (int32_t)(bbr->delivered_pkts_num - bbr->conservation_end) >= 0)
+		bbr->packet_conservation = 0;	/* a round has gone by */
+	if (bbr->packet_conservation) {
+		*new_cwnd = MAX(state->cwnd, bbr_packets_in_flight(state) + acked);
+		return true;
+	}
+	*new_cwnd = state->cwnd;
+	return false;
+}
+
 /* Slow-start up toward target cwnd (if bw estimate is growing, or packet loss
  * has drawn us down below target), or snap down to target if we're above it.
  */
-static void bbr_set_cwnd(ctcp_state_t* state, ctcp_bbr_t* bbr)
+static void bbr_set_cwnd(ctcp_state_t* state, ctcp_bbr_t* bbr, uint32_t acked)
 {
 	uint32_t cwnd = 0, target_cwnd = 0;
 
+	if (bbr_set_cwnd_to_recover(state, bbr, acked, &cwnd))
+		goto done;
+
 	/* If we're below target cwnd, slow start cwnd toward target cwnd. */
 	target_cwnd = bbr_target_cwnd(bbr, bbr->cwnd_gain);
 	if (bbr_full_bw_reached(bbr))  /* only cut cwnd if we filled the pipe */
-		cwnd = MIN(cwnd + 1, target_cwnd);
+		cwnd = MIN(cwnd + acked, target_cwnd);
 	else if (cwnd < target_cwnd || bbr->rtt_cnt < CTCP_INITIAL_CWND)
-		cwnd = cwnd + 1; // slow start
+		cwnd = cwnd + acked; // slow start
 	cwnd = MAX(cwnd, bbr_cwnd_min_target);
 
+done:
 	state->cwnd = MIN(cwnd, snd_cwnd_clamp);	/* apply global cap. snd_cwnd_clamp is upper bound of cwnd. */
 	if (bbr->mode == BBR_PROBE_RTT)  /* drain queue, refresh min_rtt. In BBR_PROBE_RTT mode, use min cwnd. */
 		state->cwnd = MIN(state->cwnd, bbr_cwnd_min_target);
@@ -344,21 +393,21 @@ static void bbr_set_pacing_rate(ctcp_state_t* state, ctcp_bbr_t* bbr)
 	uint64_t rate = bbr_max_bw(bbr); // packet-number-wise
 
 	rate = bbr_rate_bytes_per_sec(rate, bbr->pacing_gain); // convert bw's format rate(pkts<<BW_SCALE/us) => bytes/sec
+	if (state->config.max_pacing_rate)
+		rate = MIN(rate, state->config.max_pacing_rate); // like sk_max_pacing_rate
 
 	// Set pacing rate and gap btw pkts by pacing rate
 	// if (bbr->mode != BBR_STARTUP || rate > state->pacing_rate){
+	// The pacer spends credit by actual segment lengths, so only the rate is needed.
 	if(rate){
 		state->pacing_rate = rate;
-		state->pacing_gap_us = MAX(10, ((uint64_t)(MAX_SEG_DATA_SIZE)) * USEC_PER_SEC / rate);
-	}else{
-		state->pacing_gap_us = 0;
 	}
 	// }
 }
 
 static void bbr_on_send(ctcp_state_t* state, ctcp_transmission_info_t* trans_info, ctcp_bbr_t* bbr){
 
-	trans_info->rs = malloc(sizeof(ctcp_rs_t));
+	trans_info->rs = pool_alloc(&bbr_rs_pool);
 	
 	trans_info->rs->delivered = bbr->delivered_pkts_num;
 	trans_info->rs->prior_mstamp = bbr->prior_delivered_time_us;
@@ -383,8 +432,8 @@ static void bbr_on_ack(ctcp_state_t* state, ctcp_transmission_info_t* trans_info
 		bbr_update_min_rtt(state, bbr, trans_info);
         bbr_update_model(state, bbr, trans_info);
 		bbr_set_pacing_rate(state, bbr);
-        bbr_set_cwnd(state, bbr);
-        free(trans_info->rs);
+        bbr_set_cwnd(state, bbr, 1);
+        bbr_free_rate_sample(trans_info->rs);
     }
 	if(bbr->app_limited_until > 0){
 		bbr->app_limited_until -= (ntohs(trans_info->segment.len) - HDR_CTCP_SEGMENT);
@@ -398,6 +447,63 @@ static void bbr_on_ack(ctcp_state_t* state, ctcp_transmission_info_t* trans_info
             convert_bbr_mode_to_str(bbr->mode), bdp_in_bytes(bbr, BBR_UNIT),  state->cwnd, state->pacing_rate, bbr_max_bw(bbr), bbr->min_rtt_us);
 }
 
+/* Segments were taken as lost. The first loss of a recovery notes the cwnd
+ * and full pipe estimate to restore, and starts packet conservation from the
+ * segments still in the network. A timeout starts again from one segment
+ * (RFC 5681) and treats the timeout like the end of a round, so that STARTUP
+ * looks for a full pipe again.
+ */
+static void bbr_on_loss(ctcp_state_t* state, bool timeout)
+{
+	ctcp_bbr_t* bbr = state->bbr_model->bbr_object;
+
+	if (!bbr->in_recovery) {
+		bbr_save_cwnd(state, bbr);
+		bbr->undo_full_bw = bbr->full_bw;
+		bbr->undo_full_bw_cnt = bbr->full_bw_cnt;
+		bbr->undo_full_bw_reached = bbr->full_bw_reached;
+		bbr->in_recovery = 1;
+		if (!timeout) {
+			bbr->packet_conservation = 1;
+			bbr->conservation_end = bbr->delivered_pkts_num + bbr_packets_in_flight(state);
+			state->cwnd = MAX(bbr_packets_in_flight(state), 1);
+		}
+	}
+	if (timeout) {
+		bbr_save_cwnd(state, bbr);
+		bbr->packet_conservation = 0;
+		bbr->full_bw = 0;
+		state->cwnd = 1;
+	}
+}
+
+/* The recovery is over: snap back to the cwnd from before it. */
+static void bbr_on_recovery_end(ctcp_state_t* state)
+{
+	ctcp_bbr_t* bbr = state->bbr_model->bbr_object;
+
+	if (!bbr->in_recovery)
+		return;
+	state->cwnd = MAX(state->cwnd, bbr->prior_cwnd);
+	bbr->in_recovery = 0;
+	bbr->packet_conservation = 0;
+}
+
+/* The recovery was spurious: restore the full pipe estimate it reset and the
+ * cwnd from before it.
+ */
+static void bbr_on_undo(ctcp_state_t* state)
+{
+	ctcp_bbr_t* bbr = state->bbr_model->bbr_object;
+
+	if (!bbr->in_recovery)
+		return;
+	bbr->full_bw = MAX(bbr->full_bw, bbr->undo_full_bw);
+	bbr->full_bw_cnt = MAX(bbr->full_bw_cnt, bbr->undo_full_bw_cnt);
+	bbr->full_bw_reached |= bbr->undo_full_bw_reached;
+	bbr_on_recovery_end(state);
+}
+
 static void ctcp_bbr_init(ctcp_state_t* state, ctcp_bbr_t* bbr) {
     int64_t now = monotonic_current_time_us();
     
@@ -417,6 +523,12 @@ static void ctcp_bbr_init(ctcp_state_t* state, ctcp_bbr_t* bbr) {
 	bbr->full_bw = 0;
 	bbr->full_bw_cnt = 0;
 	bbr->full_bw_reached = 0;
+	bbr->in_recovery = 0;
+	bbr->packet_conservation = 0;
+	bbr->undo_full_bw = 0;
+	bbr->undo_full_bw_cnt = 0;
+	bbr->undo_full_bw_reached = 0;
+	bbr->conservation_end = 0;
 	bbr->cycle_mstamp = now;
 	bbr->cycle_idx = 0;
 }
@@ -429,6 +541,9 @@ ctcp_bbr_model_t* ctcp_bbr_create_model(ctcp_state_t* state) {
     bbr_model->bbr_object = bbr;
     bbr_model->on_send = bbr_on_send;
 	bbr_model->on_ack = bbr_on_ack;
+	bbr_model->on_loss = bbr_on_loss;
+	bbr_model->on_recovery_end = bbr_on_recovery_end;
+	bbr_model->on_undo = bbr_on_undo;
     
     return bbr_model;
 }
\ No newline at end of file
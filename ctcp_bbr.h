@@ -59,7 +59,6 @@ typedef struct {
     int64_t cycle_mstamp;  /* time of this cycle phase start */
     uint32_t     mode:3;		     /* current bbr_mode in state machine */
     // 	prev_ca_state:3,     /* CA state on previous ACK */
-    // 	packet_conservation:1,  /* use packet conservation? */
     // 	restore_cwnd:1,	     /* decided to revert cwnd to old value */
     // 	round_start:1,	     /* start of packet-timed tx->ack round? */
     // 	tso_segs_goal:7,     /* segments we want in each skb we send */
@@ -80,7 +79,13 @@ typedef struct {
     	unused_b:6;
     uint32_t	prior_cwnd;	/* prior cwnd upon entering loss recovery */
     uint32_t	full_bw;	/* recent bw, to estimate if pipe is full */
-    uint32_t full_bw_reached: 1;
+    uint32_t full_bw_reached: 1,
+    	in_recovery:1,		/* in loss recovery (or after a timeout)? */
+    	packet_conservation:1,	/* use packet conservation? */
+    	undo_full_bw_cnt:3,	/* full_bw_cnt upon entering loss recovery */
+    	undo_full_bw_reached:1;	/* full_bw_reached upon entering loss recovery */
+    uint32_t	undo_full_bw;	/* full_bw upon entering loss recovery */
+    uint32_t	conservation_end; /* delivered_pkts_num that ends packet conservation */
 
 } ctcp_bbr_t;
 
@@ -139,6 +144,8 @@ struct rate_sample {
 typedef struct rate_sample ctcp_rs_t;
 
 uint32_t bbr_max_bw(ctcp_bbr_t*);
+/* BDP * gain in bytes, from max_bw and min_rtt_us. 0 until both are measured. */
+uint64_t bdp_in_bytes(ctcp_bbr_t* bbr, uint32_t gain);
 
 typedef struct ctcp_state ctcp_state_t;
 typedef struct ctcp_transmission_info ctcp_transmission_info_t;
@@ -146,9 +153,18 @@ struct ctcp_bbr_model {
     ctcp_bbr_t* bbr_object;
     void (*on_send)(ctcp_state_t*, ctcp_transmission_info_t*, ctcp_bbr_t*);
     void (*on_ack)(ctcp_state_t*, ctcp_transmission_info_t*);
+    /* Segments were taken as lost: by a timeout, or by SACK or RACK. */
+    void (*on_loss)(ctcp_state_t*, bool timeout);
+    /* Everything outstanding when the loss was found has been acked. */
+    void (*on_recovery_end)(ctcp_state_t*);
+    /* The recovery was spurious: put back what on_loss took away. */
+    void (*on_undo)(ctcp_state_t*);
 };
 typedef struct ctcp_bbr_model ctcp_bbr_model_t;
 
 ctcp_bbr_model_t* ctcp_bbr_create_model(ctcp_state_t* state);
 
+/* Free a rate sample attached to a segment by on_send. NULL is ignored. */
+void bbr_free_rate_sample(ctcp_rs_t* rs);
+
 #endif
\ No newline at end of file
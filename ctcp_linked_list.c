@@ -41,11 +41,8 @@ ll_node_t *ll_create_node(void *object) {
   return node;
 }
 
-ll_node_t *ll_add(linked_list_t *list, void *object) {
-  if (list == NULL || object == NULL)
-    return NULL;
-
-  ll_node_t *node = ll_create_node(object);
+/** Links a node in at the back of the list. */
+static ll_node_t *link_back(linked_list_t *list, ll_node_t *node) {
   /* List is empty. */
   if (list->head == NULL) {
     list->head = node;
@@ -63,95 +60,113 @@ ll_node_t *ll_add(linked_list_t *list, void *object) {
   return node;
 }
 
-ll_node_t *ll_add_in_order(linked_list_t *list, void *object){
+/** Links a node in at the front of the list. */
+static ll_node_t *link_front(linked_list_t *list, ll_node_t *node) {
+  /* List is empty. */
+  if (list->head == NULL) {
+    list->head = node;
+    list->tail = node;
+  }
+
+  /* List has one or more elements. */
+  else {
+    node->next = list->head;
+    list->head->prev = node;
+    list->head = node;
+  }
+
+  list->length++;
+  return node;
+}
+
+/** Links new_node in after node. */
+static ll_node_t *link_after(linked_list_t *list, ll_node_t *node,
+                             ll_node_t *new_node) {
+  /* Update pointers. */
+  new_node->prev = node;
+  new_node->next = node->next;
+  if (node->next != NULL)
+    node->next->prev = new_node;
+  node->next = new_node;
+
+  /* Added to end of list. */
+  if (node == list->tail)
+    list->tail = new_node;
+
+  list->length++;
+  return new_node;
+}
+
+ll_node_t *ll_add(linked_list_t *list, void *object) {
   if (list == NULL || object == NULL)
     return NULL;
 
+  return link_back(list, ll_create_node(object));
+}
+
+/** Links object (a ctcp_segment_t) in seqno order. */
+static ll_node_t *link_in_order(linked_list_t *list, void *object) {
+  ctcp_segment_t *add_seg = (ctcp_segment_t*)object;
+  uint32_t add_seqno = ntohl(add_seg->seqno);
+
   /* List is empty. */
   if (list->head == NULL) {
-    ll_node_t *node = ll_create_node(object);
-    list->head = node;
-    list->tail = node;
-    list->length = 1;
-    return node;
+    return link_back(list, ll_create_node(object));
   }
   
   /* 1. If it is less prioritized than head.(has lower seqno than head's.),
    * Adds object into the front.
    */
-  ctcp_segment_t *add_seg = (ctcp_segment_t*)object;
   ctcp_segment_t *head_seg = (ctcp_segment_t*)list->head->object;
   ctcp_segment_t *tail_seg = (ctcp_segment_t*)list->tail->object;
-  if(head_seg->seqno > add_seg->seqno){
-    return ll_add_front(list, object);
+  if(ntohl(head_seg->seqno) > add_seqno){
+    return link_front(list, ll_create_node(object));
   }
   /* 2. If it is higher prioritized than tail.(has larger seqno than tail's.),
   * Adds object into the end.
   */
-  if(tail_seg->seqno < add_seg->seqno){  
-    return ll_add(list, object);
+  if(ntohl(tail_seg->seqno) < add_seqno){  
+    return link_back(list, ll_create_node(object));
   }
 
   /* 3. If its priority is middle of receiver buffer(has seqno between (head, tail)), 
   * Adds object into the middle where in-order rule is satisfied.
   */
   ll_node_t *curr = list->head;
-  ctcp_segment_t *curr_seg = (ctcp_segment_t*)list->head->object;
-  for(; curr_seg->seqno < add_seg->seqno; curr_seg = (ctcp_segment_t*)curr->next->object){
-    ;
+  while(curr && ntohl(((ctcp_segment_t*)curr->object)->seqno) < add_seqno){
+    curr = curr->next;
   }
   if(curr == NULL){
     fprintf(stderr,"[ERROR] Node is NULL while adding object into receiver buffer.\n");
     return NULL;
   }
-  if(curr_seg->seqno == add_seg->seqno){
+  if(ntohl(((ctcp_segment_t*)curr->object)->seqno) == add_seqno){
     fprintf(stderr,"Segment with same seqno is already in receiver buffer.\n");
     return NULL;
   }
   
-  return ll_add_after(list, curr->prev, object);
+  return link_after(list, curr->prev, ll_create_node(object));
 }
 
-ll_node_t *ll_add_front(linked_list_t *list, void *object) {
+ll_node_t *ll_add_in_order(linked_list_t *list, void *object){
   if (list == NULL || object == NULL)
     return NULL;
 
-  ll_node_t *node = ll_create_node(object);
-  /* List is empty. */
-  if (list->head == NULL) {
-    list->head = node;
-    list->tail = node;
-  }
+  return link_in_order(list, object);
+}
 
-  /* List has one or more elements. */
-  else {
-    node->next = list->head;
-    list->head->prev = node;
-    list->head = node;
-  }
+ll_node_t *ll_add_front(linked_list_t *list, void *object) {
+  if (list == NULL || object == NULL)
+    return NULL;
 
-  list->length++;
-  return node;
+  return link_front(list, ll_create_node(object));
 }
 
 ll_node_t *ll_add_after(linked_list_t *list, ll_node_t *node, void *object) {
   if (list == NULL || node == NULL || object == NULL)
     return NULL;
 
-  ll_node_t *new_node = ll_create_node(object);
-  /* Update pointers. */
-  new_node->prev = node;
-  new_node->next = node->next;
-  if (node->next != NULL)
-    node->next->prev = new_node;
-  node->next = new_node;
-
-  /* Added to end of list. */
-  if (node == list->tail)
-    list->tail = new_node;
-
-  list->length++;
-  return new_node;
+  return link_after(list, node, ll_create_node(object));
 }
 
 void *ll_remove(linked_list_t *list, ll_node_t *node) {
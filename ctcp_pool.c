@@ -0,0 +1,138 @@
+#include "ctcp_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Most pools the program uses. Each gets a per-thread cache slot. */
+#define POOL_MAX 8
+
+/** Objects moved between a thread's cache and the depot at a time. */
+#define POOL_BATCH 32
+
+/** A thread's free objects for one pool. */
+typedef struct {
+  void *head;
+  uint32_t count;
+} pool_cache_t;
+
+static __thread pool_cache_t caches[POOL_MAX];
+
+static _Atomic int num_pools = 0;
+static ctcp_pool_t *pools = NULL;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Free objects are linked through their first word. */
+#define NEXT(obj) (*(void **)(obj))
+
+/**
+ * Gives a pool its cache slot the first time it is used.
+ */
+static void pool_register(ctcp_pool_t *pool) {
+  pthread_mutex_lock(&pools_lock);
+  if (atomic_load(&pool->id) < 0) {
+    int id = atomic_fetch_add(&num_pools, 1);
+    if (id >= POOL_MAX) {
+      fprintf(stderr, "[ERROR] Too many object pools\n");
+      exit(EXIT_FAILURE);
+    }
+    pool->next = pools;
+    pools = pool;
+    atomic_store(&pool->id, id);
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+/**
+ * Refills an empty cache with a batch from the depot, allocating a slab if
+ * the depot is empty too.
+ */
+static void pool_refill(ctcp_pool_t *pool, pool_cache_t *cache) {
+  pthread_mutex_lock(&pool->lock);
+  if (pool->depot == NULL) {
+    char *slab = malloc(pool->obj_size * pool->objs_per_slab);
+    if (slab == NULL) {
+      fprintf(stderr, "[ERROR] Out of memory for %s pool\n", pool->name);
+      exit(EXIT_FAILURE);
+    }
+    uint32_t i;
+    for (i = 0; i < pool->objs_per_slab; i++) {
+      void *obj = slab + i * pool->obj_size;
+      NEXT(obj) = pool->depot;
+      pool->depot = obj;
+    }
+    pool->slabs++;
+  }
+
+  while (pool->depot != NULL && cache->count < POOL_BATCH) {
+    void *obj = pool->depot;
+    pool->depot = NEXT(obj);
+    NEXT(obj) = cache->head;
+    cache->head = obj;
+    cache->count++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Moves a batch from an overfull cache back to the depot.
+ */
+static void pool_flush(ctcp_pool_t *pool, pool_cache_t *cache) {
+  pthread_mutex_lock(&pool->lock);
+  uint32_t i;
+  for (i = 0; i < POOL_BATCH; i++) {
+    void *obj = cache->head;
+    cache->head = NEXT(obj);
+    NEXT(obj) = pool->depot;
+    pool->depot = obj;
+  }
+  cache->count -= POOL_BATCH;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void *pool_alloc(ctcp_pool_t *pool) {
+  int id = atomic_load_explicit(&pool->id, memory_order_acquire);
+  if (id < 0) {
+    pool_register(pool);
+    id = atomic_load(&pool->id);
+  }
+
+  pool_cache_t *cache = &caches[id];
+  if (cache->head == NULL)
+    pool_refill(pool, cache);
+
+  void *obj = cache->head;
+  cache->head = NEXT(obj);
+  cache->count--;
+  atomic_fetch_add_explicit(&pool->allocs, 1, memory_order_relaxed);
+  return obj;
+}
+
+void pool_free(ctcp_pool_t *pool, void *obj) {
+  if (obj == NULL)
+    return;
+
+  /* An object can only come from a pool that has been registered. */
+  pool_cache_t *cache = &caches[atomic_load_explicit(&pool->id,
+                                                     memory_order_acquire)];
+  NEXT(obj) = cache->head;
+  cache->head = obj;
+  cache->count++;
+  atomic_fetch_add_explicit(&pool->frees, 1, memory_order_relaxed);
+
+  if (cache->count >= 2 * POOL_BATCH)
+    pool_flush(pool, cache);
+}
+
+void pool_report() {
+  pthread_mutex_lock(&pools_lock);
+  ctcp_pool_t *pool;
+  for (pool = pools; pool != NULL; pool = pool->next) {
+    pthread_mutex_lock(&pool->lock);
+    uint64_t allocs = atomic_load(&pool->allocs);
+    uint64_t frees = atomic_load(&pool->frees);
+    fprintf(stderr, "[ALLOC] %s: %lu allocs, %lu in use, %lu malloc calls "
+            "(%lu objects)\n", pool->name, allocs, allocs - frees,
+            pool->slabs, pool->slabs * pool->objs_per_slab);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
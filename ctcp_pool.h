@@ -0,0 +1,71 @@
+/******************************************************************************
+ * ctcp_pool.h
+ * -----------
+ * Fixed-size object pools for the per-packet objects (segments, packets,
+ * output chunks, rate samples), so a transfer in steady state makes no
+ * malloc()/free() calls.
+ *
+ * Objects are carved out of slabs that are never returned to the system. Each
+ * thread keeps a small cache of free objects per pool and only takes the pool
+ * lock to refill or flush that cache in batches, so objects allocated on the
+ * I/O thread and freed on the protocol thread still recycle.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_POOL_H
+#define CTCP_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** A pool of objects of one size. */
+typedef struct ctcp_pool {
+  const char *name;            /* Shown in pool_report() */
+  size_t obj_size;             /* Object size, at least a pointer */
+  uint32_t objs_per_slab;      /* Objects carved out of each slab */
+  _Atomic int id;              /* Per-thread cache slot, -1 until first use */
+  pthread_mutex_t lock;        /* Protects everything below */
+  void *depot;                 /* Free objects not in any thread's cache */
+  uint64_t slabs;              /* Number of slabs (malloc() calls) */
+  _Atomic uint64_t allocs;     /* Objects handed out */
+  _Atomic uint64_t frees;      /* Objects given back */
+  struct ctcp_pool *next;      /* All pools in use, for pool_report() */
+} ctcp_pool_t;
+
+/**
+ * Static initializer for a pool.
+ *
+ * name: Name for reports.
+ * size: Object size in bytes.
+ * per_slab: Objects allocated at a time when the pool runs dry.
+ */
+#define POOL_INITIALIZER(name, size, per_slab)                              \
+  { (name), (size) < sizeof(void *) ? sizeof(void *) : (size), (per_slab),  \
+    -1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, NULL }
+
+/**
+ * Takes an object from a pool. Its contents are undefined.
+ *
+ * pool: The pool.
+ * returns: The object.
+ */
+void *pool_alloc(ctcp_pool_t *pool);
+
+/**
+ * Gives an object back to the pool it came from. Any thread may free an
+ * object, whichever thread allocated it. NULL is ignored.
+ *
+ * pool: The pool the object came from.
+ * obj: The object.
+ */
+void pool_free(ctcp_pool_t *pool, void *obj);
+
+/**
+ * Prints allocation counters for every pool that has been used. Once warmed
+ * up, the slab count stays flat however many objects go through the pool.
+ */
+void pool_report();
+
+#endif /* CTCP_POOL_H */
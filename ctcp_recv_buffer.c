@@ -0,0 +1,184 @@
+#include "ctcp.h"
+#include "ctcp_recv_buffer.h"
+
+/** Bits per bitmap word. */
+#define WORD_BITS 64
+
+/** Rounds up to the next power of two, at least one bitmap word. */
+static uint32_t round_up_pow2(uint32_t n) {
+  uint32_t size = WORD_BITS;
+  while (size < n)
+    size <<= 1;
+  return size;
+}
+
+void rcvbuf_init(ctcp_recv_buffer_t *buf, uint32_t seqno, uint32_t window) {
+  memset(buf, 0, sizeof(ctcp_recv_buffer_t));
+  buf->size = round_up_pow2(window);
+  buf->data = malloc(buf->size);
+  buf->received = calloc(sizeof(uint64_t), buf->size / WORD_BITS);
+  buf->window = window;
+  buf->start_seqno = seqno;
+}
+
+void rcvbuf_destroy(ctcp_recv_buffer_t *buf) {
+  free(buf->data);
+  free(buf->received);
+  buf->data = NULL;
+  buf->received = NULL;
+}
+
+/**
+ * Sets (or clears) the bits of len bytes from ring offset off, which must not
+ * wrap. A word at a time.
+ *
+ * returns: The number of bits that changed.
+ */
+static uint32_t mark_linear(ctcp_recv_buffer_t *buf, uint32_t off,
+                            uint32_t len, bool set) {
+  uint32_t changed = 0;
+  while (len > 0) {
+    uint32_t bit = off % WORD_BITS;
+    uint32_t n = MIN(len, WORD_BITS - bit);
+    uint64_t mask = (n == WORD_BITS ? ~0ULL : ((1ULL << n) - 1)) << bit;
+    uint64_t *word = &buf->received[off / WORD_BITS];
+    if (set) {
+      changed += __builtin_popcountll(mask & ~*word);
+      *word |= mask;
+    }
+    else {
+      changed += __builtin_popcountll(mask & *word);
+      *word &= ~mask;
+    }
+    off += n;
+    len -= n;
+  }
+  return changed;
+}
+
+/**
+ * Sets (or clears) the bits of len bytes from ring offset off, wrapping around
+ * the end if needed.
+ *
+ * returns: The number of bits that changed.
+ */
+static uint32_t mark(ctcp_recv_buffer_t *buf, uint32_t off, uint32_t len,
+                     bool set) {
+  off &= buf->size - 1;
+  uint32_t first = MIN(len, buf->size - off);
+  return mark_linear(buf, off, first, set) +
+         mark_linear(buf, 0, len - first, set);
+}
+
+/**
+ * Counts the bytes from rel (relative to start_seqno) that have been received,
+ * or that are missing, up to limit. A word of the bitmap at a time.
+ *
+ * received: Whether to count received bytes or missing ones.
+ * returns: The length of the run.
+ */
+static uint32_t run_length(const ctcp_recv_buffer_t *buf, uint32_t rel,
+                           uint32_t limit, bool received) {
+  uint32_t len = 0;
+  while (rel + len < limit) {
+    uint32_t off = (buf->start + rel + len) & (buf->size - 1);
+    uint32_t bit = off % WORD_BITS;
+    uint64_t word = buf->received[off / WORD_BITS] >> bit;
+    uint64_t other = received ? ~word : word;
+    uint32_t n = other == 0 ? WORD_BITS : __builtin_ctzll(other);
+    len += MIN(n, WORD_BITS - bit);
+    if (n < WORD_BITS - bit)
+      break;
+  }
+  return MIN(len, limit - rel);
+}
+
+/**
+ * Moves the in-order frontier up to the next hole.
+ */
+static void advance_ready(ctcp_recv_buffer_t *buf) {
+  buf->ready += run_length(buf, buf->ready, buf->end, true);
+}
+
+uint32_t rcvbuf_insert(ctcp_recv_buffer_t *buf, uint32_t seqno,
+                       const uint8_t *data, uint32_t len) {
+  /* Drop what has been output already, then what is past the window. */
+  if ((int32_t)(seqno - buf->start_seqno) < 0) {
+    uint32_t old = MIN(buf->start_seqno - seqno, len);
+    seqno += old;
+    data += old;
+    len -= old;
+  }
+  uint32_t rel = seqno - buf->start_seqno;
+  if (len == 0 || rel >= buf->window)
+    return 0;
+  len = MIN(len, buf->window - rel);
+
+  uint32_t off = (buf->start + rel) & (buf->size - 1);
+  uint32_t first = MIN(len, buf->size - off);
+  memcpy(buf->data + off, data, first);
+  memcpy(buf->data, data + first, len - first);
+
+  uint32_t fresh = mark(buf, off, len, true);
+  buf->held += fresh;
+  buf->end = MAX(buf->end, rel + len);
+  if (fresh > 0)
+    buf->latest_seqno = seqno;
+  if (rel <= buf->ready)
+    advance_ready(buf);
+  return fresh;
+}
+
+int rcvbuf_readable(ctcp_recv_buffer_t *buf, struct iovec iov[2]) {
+  if (buf->ready == 0)
+    return 0;
+  uint32_t first = MIN(buf->ready, buf->size - buf->start);
+  iov[0].iov_base = buf->data + buf->start;
+  iov[0].iov_len = first;
+  if (first == buf->ready)
+    return 1;
+  iov[1].iov_base = buf->data;
+  iov[1].iov_len = buf->ready - first;
+  return 2;
+}
+
+void rcvbuf_consume(ctcp_recv_buffer_t *buf, uint32_t len) {
+  mark(buf, buf->start, len, false);
+  buf->start = (buf->start + len) & (buf->size - 1);
+  buf->start_seqno += len;
+  buf->ready -= len;
+  buf->held -= len;
+  buf->end -= len;
+}
+
+int rcvbuf_sack_blocks(const ctcp_recv_buffer_t *buf, ctcp_sack_block_t *blocks,
+                       int max_blocks) {
+  int n = 0;
+  bool have_latest =
+      (int32_t)(buf->latest_seqno - (buf->start_seqno + buf->ready)) < 0;
+  uint32_t rel = buf->ready;
+  while (rel < buf->end) {
+    rel += run_length(buf, rel, buf->end, false);
+    uint32_t len = run_length(buf, rel, buf->end, true);
+    if (len == 0)
+      break;
+    ctcp_sack_block_t block = { buf->start_seqno + rel,
+                                buf->start_seqno + rel + len };
+    rel += len;
+
+    /* The latest block goes first. Until it has come up, keep a slot for
+       it (unless the latest data was in order). */
+    if (buf->latest_seqno - block.start < len) {
+      memmove(blocks + 1, blocks, MIN(n, max_blocks - 1) * sizeof(block));
+      blocks[0] = block;
+      n = MIN(n + 1, max_blocks);
+      have_latest = true;
+    }
+    else if (n < max_blocks - (have_latest ? 0 : 1)) {
+      blocks[n++] = block;
+    }
+    if (n == max_blocks && have_latest)
+      break;
+  }
+  return n;
+}
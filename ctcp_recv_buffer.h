@@ -0,0 +1,113 @@
+/******************************************************************************
+ * ctcp_recv_buffer.h
+ * ------------------
+ * Receiver-side reassembly buffer. Received data is copied straight to its
+ * place in a circular byte buffer covering the receive window, and a bitmap
+ * with one bit per byte records which bytes have arrived:
+ *
+ *    start_seqno                         start_seqno + window
+ *     | in order (ready) | holes and out-of-order bytes |
+ *
+ * Segments can arrive in any order, overlap or be duplicated (collapsed
+ * retransmissions start anywhere), and only the bytes not seen before count.
+ * Bytes from start_seqno up to the first hole are ready for output, and
+ * outputting them moves the window along. The blocks received past the first
+ * hole are reported to the sender as SACK blocks.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_RECV_BUFFER_H
+#define CTCP_RECV_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "ctcp_sys.h"
+
+typedef struct {
+  uint8_t *data;            /* Byte buffer. Size is a power of two. */
+  uint64_t *received;       /* One bit per byte of data, set once received. */
+  uint32_t size;
+  uint32_t window;          /* Bytes accepted past start_seqno. */
+  uint32_t start;           /* Offset of the byte at start_seqno. */
+  uint32_t start_seqno;     /* Sequence number of the first byte not output. */
+  uint32_t ready;           /* Bytes from start_seqno received in order. */
+  uint32_t held;            /* Bytes received and not output, in order or
+                               not. */
+  uint32_t end;             /* Bytes from start_seqno to the end of the
+                               furthest data received. */
+  uint32_t latest_seqno;    /* Start of the latest data received. */
+} ctcp_recv_buffer_t;
+
+/**
+ * Sets up an empty reassembly buffer.
+ *
+ * buf: The buffer.
+ * seqno: Sequence number of the first byte expected.
+ * window: Bytes accepted ahead of the first byte not output yet. Anything
+ *         further ahead is dropped.
+ */
+void rcvbuf_init(ctcp_recv_buffer_t *buf, uint32_t seqno, uint32_t window);
+
+/**
+ * Frees the memory held by a reassembly buffer.
+ */
+void rcvbuf_destroy(ctcp_recv_buffer_t *buf);
+
+/**
+ * Copies received data into place. Bytes already output or beyond the window
+ * are dropped.
+ *
+ * buf: The buffer.
+ * seqno: Sequence number of the first byte of data.
+ * data: Received data.
+ * len: Length of data.
+ * returns: The number of bytes that had not been received before.
+ */
+uint32_t rcvbuf_insert(ctcp_recv_buffer_t *buf, uint32_t seqno,
+                       const uint8_t *data, uint32_t len);
+
+/**
+ * Returns the bytes that are ready for output as up to two regions (two when
+ * they wrap). Output them, then call rcvbuf_consume().
+ *
+ * buf: The buffer.
+ * iov: Filled in with the regions.
+ * returns: The number of regions, 0 if nothing is ready.
+ */
+int rcvbuf_readable(ctcp_recv_buffer_t *buf, struct iovec iov[2]);
+
+/**
+ * Drops len bytes that have been output from the front of the buffer, which
+ * moves the window along.
+ *
+ * buf: The buffer.
+ * len: Bytes output, at most rcvbuf_ready().
+ */
+void rcvbuf_consume(ctcp_recv_buffer_t *buf, uint32_t len);
+
+/**
+ * Describes the blocks received past the first hole, for SACK. The block with
+ * the latest data received comes first, then the others in sequence order as
+ * far as they fit (RFC 2018).
+ *
+ * buf: The buffer.
+ * blocks: Filled in with the blocks.
+ * max_blocks: Room in blocks.
+ * returns: The number of blocks, 0 if there is no hole.
+ */
+int rcvbuf_sack_blocks(const ctcp_recv_buffer_t *buf, ctcp_sack_block_t *blocks,
+                       int max_blocks);
+
+/** Number of bytes ready for output. */
+static inline uint32_t rcvbuf_ready(const ctcp_recv_buffer_t *buf) {
+  return buf->ready;
+}
+
+/** Whether data up to end_seqno lies within the window as it stands. */
+static inline bool rcvbuf_fits(const ctcp_recv_buffer_t *buf,
+                               uint32_t end_seqno) {
+  return (int32_t)(end_seqno - (buf->start_seqno + buf->window)) <= 0;
+}
+
+#endif /* CTCP_RECV_BUFFER_H */
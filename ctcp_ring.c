@@ -0,0 +1,22 @@
+#include "ctcp_ring.h"
+#include <stdlib.h>
+
+spsc_ring_t *spsc_ring_create(uint32_t capacity) {
+  uint32_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+
+  spsc_ring_t *ring = calloc(sizeof(spsc_ring_t), 1);
+  ring->slots = calloc(sizeof(void *), size);
+  ring->mask = size - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  return ring;
+}
+
+void spsc_ring_destroy(spsc_ring_t *ring) {
+  if (ring == NULL)
+    return;
+  free(ring->slots);
+  free(ring);
+}
@@ -0,0 +1,84 @@
+/******************************************************************************
+ * ctcp_ring.h
+ * -----------
+ * Lock-free single-producer/single-consumer ring of pointers. Used to hand
+ * packets between the I/O thread and the protocol thread in pipelined mode.
+ * Exactly one thread may push and exactly one (other) thread may pop.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_RING_H
+#define CTCP_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_CACHE_LINE 64
+
+/** A single-producer/single-consumer ring. */
+typedef struct {
+  _Atomic uint32_t head;   /* Next slot to write. Written by the producer. */
+  char pad_head[RING_CACHE_LINE - sizeof(uint32_t)];
+  _Atomic uint32_t tail;   /* Next slot to read. Written by the consumer. */
+  char pad_tail[RING_CACHE_LINE - sizeof(uint32_t)];
+  uint32_t mask;           /* Capacity - 1. Capacity is a power of two. */
+  void **slots;
+} spsc_ring_t;
+
+/**
+ * Creates a ring. Must be freed with spsc_ring_destroy().
+ *
+ * capacity: Number of slots. Rounded up to a power of two.
+ * returns: The new ring.
+ */
+spsc_ring_t *spsc_ring_create(uint32_t capacity);
+
+/**
+ * Destroys a ring. Does not free the objects still in it.
+ */
+void spsc_ring_destroy(spsc_ring_t *ring);
+
+/**
+ * [Producer only] Adds an object to the ring.
+ *
+ * returns: true on success, false if the ring is full.
+ */
+static inline bool spsc_ring_push(spsc_ring_t *ring, void *object) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail > ring->mask)
+    return false;
+
+  ring->slots[head & ring->mask] = object;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+/**
+ * [Consumer only] Removes the oldest object from the ring.
+ *
+ * returns: The object, or NULL if the ring is empty.
+ */
+static inline void *spsc_ring_pop(spsc_ring_t *ring) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail == head)
+    return NULL;
+
+  void *object = ring->slots[tail & ring->mask];
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return object;
+}
+
+/**
+ * Returns whether the ring is empty. Exact for the consumer, a snapshot for
+ * the producer.
+ */
+static inline bool spsc_ring_empty(spsc_ring_t *ring) {
+  return atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+         atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+#endif /* CTCP_RING_H */
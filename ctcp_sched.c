@@ -0,0 +1,100 @@
+#include "ctcp_sched.h"
+#include <stdlib.h>
+
+/** Initial number of heap slots. Doubles when full. */
+#define SCHED_INITIAL_SIZE 16
+
+/** Whether entry a departs before entry b. */
+static bool departs_before(const sched_entry_t *a, const sched_entry_t *b) {
+  if (a->time_us != b->time_us)
+    return a->time_us < b->time_us;
+  return a->order < b->order;
+}
+
+/**
+ * Puts an entry in slot i and tells its flow where it is.
+ */
+static void place(ctcp_sched_t *sched, int i, sched_entry_t entry) {
+  sched->entries[i] = entry;
+  *entry.index = i;
+}
+
+/**
+ * Moves the entry in slot i up towards the root until its parent departs
+ * first.
+ */
+static void sift_up(ctcp_sched_t *sched, int i) {
+  sched_entry_t entry = sched->entries[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!departs_before(&entry, &sched->entries[parent]))
+      break;
+    place(sched, i, sched->entries[parent]);
+    i = parent;
+  }
+  place(sched, i, entry);
+}
+
+/**
+ * Moves the entry in slot i down until both its children depart after it.
+ */
+static void sift_down(ctcp_sched_t *sched, int i) {
+  sched_entry_t entry = sched->entries[i];
+  while (true) {
+    int child = 2 * i + 1;
+    if (child >= sched->len)
+      break;
+    if (child + 1 < sched->len &&
+        departs_before(&sched->entries[child + 1], &sched->entries[child]))
+      child++;
+    if (!departs_before(&sched->entries[child], &entry))
+      break;
+    place(sched, i, sched->entries[child]);
+    i = child;
+  }
+  place(sched, i, entry);
+}
+
+void sched_queue(ctcp_sched_t *sched, void *flow, int *index, uint64_t time_us) {
+  sched_remove(sched, index);
+  if (sched->len == sched->size) {
+    sched->size = sched->size ? sched->size * 2 : SCHED_INITIAL_SIZE;
+    sched->entries = realloc(sched->entries,
+                             sched->size * sizeof(sched_entry_t));
+  }
+
+  sched_entry_t entry = { time_us, sched->next_order++, flow, index };
+  place(sched, sched->len++, entry);
+  sift_up(sched, sched->len - 1);
+}
+
+void sched_remove(ctcp_sched_t *sched, int *index) {
+  int i = *index;
+  if (i == SCHED_NOT_QUEUED)
+    return;
+  *index = SCHED_NOT_QUEUED;
+
+  /* Fill the hole with the last entry, which may belong above or below it. */
+  if (--sched->len == i)
+    return;
+  place(sched, i, sched->entries[sched->len]);
+  if (i > 0 && departs_before(&sched->entries[i], &sched->entries[(i - 1) / 2]))
+    sift_up(sched, i);
+  else
+    sift_down(sched, i);
+}
+
+void *sched_pop(ctcp_sched_t *sched, uint64_t now_us) {
+  if (sched->len == 0 || sched->entries[0].time_us > now_us)
+    return NULL;
+  void *flow = sched->entries[0].flow;
+  sched_remove(sched, sched->entries[0].index);
+  return flow;
+}
+
+void sched_destroy(ctcp_sched_t *sched) {
+  free(sched->entries);
+  sched->entries = NULL;
+  sched->len = 0;
+  sched->size = 0;
+}
@@ -0,0 +1,77 @@
+/******************************************************************************
+ * ctcp_sched.h
+ * ------------
+ * Earliest-departure-time scheduler shared by all connections. Each flow with
+ * data waiting is keyed by the time it may next send, and a binary min-heap
+ * orders them, so the pacer serves the globally earliest departure first
+ * however many connections there are.
+ *
+ * Flows with the same departure time come out in the order they were queued,
+ * and a flow that has been served is queued again behind them, which makes
+ * flows that are ready at once take turns (round-robin).
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_SCHED_H
+#define CTCP_SCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Heap index of a flow that is not queued. */
+#define SCHED_NOT_QUEUED -1
+
+typedef struct {
+  uint64_t time_us;         /* Departure time. */
+  uint64_t order;           /* Queueing order. Breaks ties first come first. */
+  void *flow;
+  int *index;               /* Where the flow keeps its heap index. */
+} sched_entry_t;
+
+typedef struct {
+  sched_entry_t *entries;   /* Binary min-heap on (time_us, order). */
+  int len;
+  int size;
+  uint64_t next_order;
+} ctcp_sched_t;
+
+/**
+ * Queues a flow to depart at time_us, moving it if it is already queued. A
+ * zero-initialized ctcp_sched_t is an empty scheduler.
+ *
+ * sched: The scheduler.
+ * flow: The flow, handed back by sched_pop().
+ * index: The flow's heap index, SCHED_NOT_QUEUED while it is not queued. Kept
+ *        up to date by the scheduler.
+ * time_us: Departure time.
+ */
+void sched_queue(ctcp_sched_t *sched, void *flow, int *index, uint64_t time_us);
+
+/**
+ * Takes a flow off the scheduler. Does nothing if it is not queued.
+ *
+ * index: The flow's heap index.
+ */
+void sched_remove(ctcp_sched_t *sched, int *index);
+
+/**
+ * Takes the earliest flow off the scheduler if it is due.
+ *
+ * sched: The scheduler.
+ * now_us: Current time.
+ * returns: The flow, NULL if none departs by now_us.
+ */
+void *sched_pop(ctcp_sched_t *sched, uint64_t now_us);
+
+/**
+ * Frees the memory held by a scheduler. It is left empty and can be used
+ * again.
+ */
+void sched_destroy(ctcp_sched_t *sched);
+
+/** Departure time of the earliest flow, 0 if none is queued. */
+static inline uint64_t sched_next_us(const ctcp_sched_t *sched) {
+  return sched->len > 0 ? sched->entries[0].time_us : 0;
+}
+
+#endif /* CTCP_SCHED_H */
@@ -0,0 +1,224 @@
+#include "ctcp.h"
+#include "ctcp_send_buffer.h"
+
+/** Initial sizes. Both are powers of two and double when full. */
+#define SNDBUF_INITIAL_BYTES (16 * MAX_SEG_DATA_SIZE)
+#define SNDBUF_INITIAL_DESCS 16
+
+/** Rounds up to the next power of two. */
+static uint32_t round_up_pow2(uint32_t n) {
+  uint32_t size = 1;
+  while (size < n)
+    size <<= 1;
+  return size;
+}
+
+void sndbuf_init(ctcp_send_buffer_t *buf, uint32_t seqno) {
+  memset(buf, 0, sizeof(ctcp_send_buffer_t));
+  buf->data_size = round_up_pow2(SNDBUF_INITIAL_BYTES);
+  buf->data = malloc(buf->data_size);
+  buf->descs_size = SNDBUF_INITIAL_DESCS;
+  buf->descs = calloc(sizeof(ctcp_transmission_info_t), buf->descs_size);
+  buf->start_seqno = seqno;
+  buf->next_seqno = seqno;
+}
+
+void sndbuf_destroy(ctcp_send_buffer_t *buf) {
+  free(buf->data);
+  free(buf->descs);
+  buf->data = NULL;
+  buf->descs = NULL;
+}
+
+ctcp_transmission_info_t *sndbuf_desc(ctcp_send_buffer_t *buf, uint32_t i) {
+  return &buf->descs[i & (buf->descs_size - 1)];
+}
+
+uint32_t sndbuf_find(ctcp_send_buffer_t *buf, uint32_t seqno) {
+  uint32_t first = buf->head;
+  uint32_t count = buf->next - buf->head;
+  while (count > 0) {
+    uint32_t half = count / 2;
+    ctcp_segment_t *segment = &sndbuf_desc(buf, first + half)->segment;
+    uint32_t end = ntohl(segment->seqno) + ntohs(segment->len) - HDR_CTCP_SEGMENT;
+    if (end <= seqno) {
+      first += half + 1;
+      count -= half + 1;
+    }
+    else {
+      count = half;
+    }
+  }
+  return first;
+}
+
+/**
+ * Copies len bytes starting at ring offset off out of the byte buffer,
+ * wrapping around the end if needed.
+ */
+static void copy_out(const ctcp_send_buffer_t *buf, uint32_t off,
+                     uint8_t *to, uint32_t len) {
+  off &= buf->data_size - 1;
+  uint32_t first = MIN(len, buf->data_size - off);
+  memcpy(to, buf->data + off, first);
+  memcpy(to + first, buf->data, len - first);
+}
+
+/**
+ * Doubles the byte buffer until it can take len more bytes. The contents are
+ * laid out from offset 0 in the new buffer.
+ */
+static void grow_data(ctcp_send_buffer_t *buf, uint32_t len) {
+  uint32_t size = buf->data_size;
+  while (buf->data_len + len > size)
+    size <<= 1;
+  if (size == buf->data_size)
+    return;
+
+  uint8_t *data = malloc(size);
+  copy_out(buf, buf->data_start, data, buf->data_len);
+  free(buf->data);
+  buf->data = data;
+  buf->data_size = size;
+  buf->data_start = 0;
+}
+
+/**
+ * Doubles the descriptor ring. Indices are free-running, so each descriptor
+ * just moves to its slot under the new mask.
+ */
+static void grow_descs(ctcp_send_buffer_t *buf) {
+  uint32_t size = buf->descs_size << 1;
+  ctcp_transmission_info_t *descs = calloc(sizeof(ctcp_transmission_info_t),
+                                           size);
+  uint32_t i;
+  for (i = buf->head; i != buf->next; i++)
+    descs[i & (size - 1)] = *sndbuf_desc(buf, i);
+  free(buf->descs);
+  buf->descs = descs;
+  buf->descs_size = size;
+}
+
+/**
+ * Goes back to holding copies once every byte of an attached mapping has been
+ * acknowledged.
+ */
+static void detach_if_done(ctcp_send_buffer_t *buf) {
+  if (buf->map != NULL && buf->data_len == 0) {
+    buf->map = NULL;
+    buf->data_start = 0;
+  }
+}
+
+void sndbuf_attach(ctcp_send_buffer_t *buf, const void *map, uint32_t len) {
+  buf->map = map;
+  buf->map_start = 0;
+  buf->data_len = len;
+}
+
+int sndbuf_write_space(ctcp_send_buffer_t *buf, struct iovec iov[2],
+                       uint32_t max_len) {
+  detach_if_done(buf);
+  if (max_len == 0 || buf->map != NULL)
+    return 0;
+  if (buf->data_len == buf->data_size && buf->data_size < SNDBUF_MAX_BYTES)
+    grow_data(buf, buf->data_size);
+
+  uint32_t free_len = MIN(buf->data_size - buf->data_len, max_len);
+  if (free_len == 0)
+    return 0;
+
+  uint32_t off = (buf->data_start + buf->data_len) & (buf->data_size - 1);
+  uint32_t first = MIN(free_len, buf->data_size - off);
+  iov[0].iov_base = buf->data + off;
+  iov[0].iov_len = first;
+  if (first == free_len)
+    return 1;
+  iov[1].iov_base = buf->data;
+  iov[1].iov_len = free_len - first;
+  return 2;
+}
+
+void sndbuf_commit(ctcp_send_buffer_t *buf, uint32_t len) {
+  buf->data_len += len;
+}
+
+void sndbuf_append(ctcp_send_buffer_t *buf, const uint8_t *data,
+                   uint32_t len) {
+  detach_if_done(buf);
+  grow_data(buf, len);
+
+  /* Copy the data in behind what is already there. */
+  uint32_t off = (buf->data_start + buf->data_len) & (buf->data_size - 1);
+  uint32_t first = MIN(len, buf->data_size - off);
+  memcpy(buf->data + off, data, first);
+  memcpy(buf->data, data + first, len - first);
+  buf->data_len += len;
+}
+
+ctcp_transmission_info_t *sndbuf_cut(ctcp_send_buffer_t *buf, uint8_t flags,
+                                     uint32_t max_len) {
+  uint32_t len = MIN(sndbuf_unsent(buf), max_len);
+  if (len == 0)
+    return NULL;
+  if (buf->next - buf->head == buf->descs_size)
+    grow_descs(buf);
+
+  ctcp_transmission_info_t *desc = sndbuf_desc(buf, buf->next++);
+  memset(desc, 0, sizeof(ctcp_transmission_info_t));
+  desc->segment.seqno = htonl(buf->next_seqno);
+  desc->segment.len = htons(HDR_CTCP_SEGMENT + len);
+  desc->segment.flags = flags;
+  buf->next_seqno += len;
+  return desc;
+}
+
+uint16_t sndbuf_build_segment(ctcp_send_buffer_t *buf,
+                              ctcp_transmission_info_t *desc,
+                              ctcp_segment_t *out) {
+  uint16_t len = ntohs(desc->segment.len);
+  uint32_t offset = ntohl(desc->segment.seqno) - buf->start_seqno;
+  memcpy(out, &desc->segment, HDR_CTCP_SEGMENT);
+  if (buf->map != NULL)
+    memcpy(out->data, buf->map + buf->map_start + offset,
+           len - HDR_CTCP_SEGMENT);
+  else
+    copy_out(buf, buf->data_start + offset, (uint8_t *)out->data,
+             len - HDR_CTCP_SEGMENT);
+  return len;
+}
+
+void sndbuf_merge_next(ctcp_send_buffer_t *buf, uint32_t i) {
+  ctcp_transmission_info_t *desc = sndbuf_desc(buf, i);
+  uint16_t len = ntohs(sndbuf_desc(buf, i + 1)->segment.len) - HDR_CTCP_SEGMENT;
+  desc->segment.len = htons(ntohs(desc->segment.len) + len);
+
+  uint32_t j;
+  for (j = i + 1; j + 1 != buf->next; j++)
+    *sndbuf_desc(buf, j) = *sndbuf_desc(buf, j + 1);
+  buf->next--;
+}
+
+/**
+ * Drops len bytes from the front of the buffer.
+ */
+static void release_bytes(ctcp_send_buffer_t *buf, uint32_t len) {
+  if (buf->map != NULL)
+    buf->map_start += len;
+  else
+    buf->data_start = (buf->data_start + len) & (buf->data_size - 1);
+  buf->data_len -= len;
+  buf->start_seqno += len;
+}
+
+void sndbuf_release_head(ctcp_send_buffer_t *buf) {
+  ctcp_transmission_info_t *desc = sndbuf_desc(buf, buf->head++);
+  release_bytes(buf, ntohs(desc->segment.len) - HDR_CTCP_SEGMENT);
+}
+
+void sndbuf_trim_head(ctcp_send_buffer_t *buf, uint32_t len) {
+  ctcp_transmission_info_t *desc = sndbuf_desc(buf, buf->head);
+  desc->segment.seqno = htonl(ntohl(desc->segment.seqno) + len);
+  desc->segment.len = htons(ntohs(desc->segment.len) - len);
+  release_bytes(buf, len);
+}
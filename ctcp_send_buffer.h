@@ -0,0 +1,197 @@
+/******************************************************************************
+ * ctcp_send_buffer.h
+ * ------------------
+ * Sender-side buffer. The byte stream that has not been acknowledged yet
+ * lives in one circular byte buffer. Input is copied straight into it, and
+ * segments are only cut from the queued bytes when they are sent. Each sent
+ * segment is a small descriptor (a ctcp_transmission_info_t header without a
+ * private payload copy) kept in a circular descriptor array in sequence
+ * order:
+ *
+ *    start_seqno         next_seqno              end of data
+ *     | descriptors head..next | bytes not sent yet |
+ *
+ * A cumulative ACK releases descriptors from the head and their bytes from the
+ * front of the byte buffer. Sends and retransmits rebuild the segment from the
+ * descriptor and the bytes it covers.
+ *
+ * The bytes can also come from a mapped input file (sndbuf_attach()). The
+ * whole file is then queued at once, and segments are views into the mapping.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_SEND_BUFFER_H
+#define CTCP_SEND_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct ctcp_transmission_info ctcp_transmission_info_t;
+typedef struct ctcp_segment ctcp_segment_t;
+
+/** Most bytes the send buffer holds. Input stops being read once it is full. */
+#define SNDBUF_MAX_BYTES (1 << 20)
+
+typedef struct {
+  uint8_t *data;            /* Byte buffer. Size is a power of two. */
+  uint32_t data_size;
+  uint32_t data_start;      /* Offset of the first unacknowledged byte. */
+  uint32_t data_len;        /* Number of bytes held, sent or not. */
+  uint32_t start_seqno;     /* Sequence number of the byte at data_start. */
+  uint32_t next_seqno;      /* Sequence number of the first unsent byte. */
+
+  const uint8_t *map;       /* Mapped input holding the bytes instead of data,
+                               NULL if none. */
+  uint32_t map_start;       /* Offset in map of the byte at start_seqno. */
+
+  ctcp_transmission_info_t *descs; /* Descriptors. Size is a power of two. */
+  uint32_t descs_size;
+  uint32_t head;            /* Oldest unacknowledged descriptor. */
+  uint32_t next;            /* One past the newest descriptor. */
+} ctcp_send_buffer_t;
+
+/**
+ * Sets up an empty send buffer. Both rings grow as needed, the byte buffer
+ * up to SNDBUF_MAX_BYTES.
+ *
+ * buf: The send buffer.
+ * seqno: Sequence number of the first byte that will be queued.
+ */
+void sndbuf_init(ctcp_send_buffer_t *buf, uint32_t seqno);
+
+/**
+ * Frees the memory held by a send buffer.
+ */
+void sndbuf_destroy(ctcp_send_buffer_t *buf);
+
+/**
+ * Returns the free space at the end of the byte buffer as up to two regions
+ * (two when it wraps), growing the buffer first if it is full and still
+ * below SNDBUF_MAX_BYTES. Fill them, then call sndbuf_commit().
+ *
+ * buf: The send buffer.
+ * iov: Filled in with the free regions.
+ * max_len: Most bytes to return space for.
+ * returns: The number of regions, 0 if the buffer is full or max_len is 0.
+ */
+int sndbuf_write_space(ctcp_send_buffer_t *buf, struct iovec iov[2],
+                       uint32_t max_len);
+
+/**
+ * Queues a mapped input file without copying it. Segments are built from the
+ * mapping, which must stay valid until the bytes are acknowledged. The buffer
+ * must be empty; once the file is acknowledged it goes back to holding copies.
+ *
+ * buf: The send buffer.
+ * map: The mapping.
+ * len: Length of the mapping. Consumes this much sequence space.
+ */
+void sndbuf_attach(ctcp_send_buffer_t *buf, const void *map, uint32_t len);
+
+/**
+ * Queues bytes written into the regions from sndbuf_write_space().
+ *
+ * buf: The send buffer.
+ * len: Number of bytes written.
+ */
+void sndbuf_commit(ctcp_send_buffer_t *buf, uint32_t len);
+
+/**
+ * Queues a copy of data, growing the byte buffer if needed.
+ *
+ * buf: The send buffer.
+ * data: Data to queue.
+ * len: Length of data. Consumes this much sequence space.
+ */
+void sndbuf_append(ctcp_send_buffer_t *buf, const uint8_t *data, uint32_t len);
+
+/**
+ * Cuts the next segment from the queued bytes. The descriptor's segment
+ * header gets the sequence number, length and flags; ackno, window and
+ * checksum are filled in when it is sent.
+ *
+ * buf: The send buffer.
+ * flags: Segment flags (network order).
+ * max_len: Most data bytes to put in the segment.
+ * returns: The new descriptor, NULL if no bytes are queued. Only valid until
+ *          the next segment is cut.
+ */
+ctcp_transmission_info_t *sndbuf_cut(ctcp_send_buffer_t *buf, uint8_t flags,
+                                     uint32_t max_len);
+
+/**
+ * Returns descriptor i (head <= i < next).
+ */
+ctcp_transmission_info_t *sndbuf_desc(ctcp_send_buffer_t *buf, uint32_t i);
+
+/**
+ * Finds the first in-flight segment that ends after seqno, by binary search.
+ *
+ * buf: The send buffer.
+ * seqno: Sequence number.
+ * returns: Its descriptor index, next if there is none.
+ */
+uint32_t sndbuf_find(ctcp_send_buffer_t *buf, uint32_t seqno);
+
+/**
+ * Copies a segment (header from the descriptor, data from the byte buffer)
+ * into out, which must have room for the header and MAX_SEG_DATA_SIZE bytes.
+ *
+ * returns: Total length of the segment.
+ */
+uint16_t sndbuf_build_segment(ctcp_send_buffer_t *buf,
+                              ctcp_transmission_info_t *desc,
+                              ctcp_segment_t *out);
+
+/**
+ * Merges descriptor i + 1 into descriptor i, so that segment i also covers
+ * the bytes of the segment after it. Later descriptors move down one slot.
+ * Only the segment length changes; the caller folds in any other state of the
+ * merged descriptor first.
+ *
+ * buf: The send buffer.
+ * i: Descriptor to extend (head <= i, i + 1 < next).
+ */
+void sndbuf_merge_next(ctcp_send_buffer_t *buf, uint32_t i);
+
+/**
+ * Releases the oldest in-flight segment and the bytes it covers.
+ */
+void sndbuf_release_head(ctcp_send_buffer_t *buf);
+
+/**
+ * Releases the first len bytes of the oldest in-flight segment, which then
+ * starts after them. For ACKs that end inside a segment.
+ *
+ * buf: The send buffer.
+ * len: Bytes to release, fewer than the segment holds.
+ */
+void sndbuf_trim_head(ctcp_send_buffer_t *buf, uint32_t len);
+
+/** Number of segments sent but not yet acknowledged. */
+static inline uint32_t sndbuf_in_flight(const ctcp_send_buffer_t *buf) {
+  return buf->next - buf->head;
+}
+
+/** Number of bytes queued but not sent yet. */
+static inline uint32_t sndbuf_unsent(const ctcp_send_buffer_t *buf) {
+  return buf->start_seqno + buf->data_len - buf->next_seqno;
+}
+
+/**
+ * Whether the buffer can't take more bytes. An attached mapping takes no more
+ * until all of it has been acknowledged.
+ */
+static inline bool sndbuf_full(const ctcp_send_buffer_t *buf) {
+  if (buf->map != NULL)
+    return buf->data_len > 0;
+  return buf->data_len >= SNDBUF_MAX_BYTES;
+}
+
+/** Whether every queued byte has been sent and acknowledged. */
+static inline bool sndbuf_empty(const ctcp_send_buffer_t *buf) {
+  return buf->data_len == 0;
+}
+
+#endif /* CTCP_SEND_BUFFER_H */
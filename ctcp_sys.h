@@ -30,6 +30,7 @@
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 /** Connection object. Used to identify the receiver of sent segments.
@@ -70,6 +71,18 @@ typedef struct ctcp_segment {
  */
 int conn_input(conn_t *conn, void *buf, size_t len);
 
+/**
+ * Like conn_input(), but reads into several buffers in order, so input can go
+ * straight into a circular buffer that wraps. Reads as much as is available
+ * and fits.
+ *
+ * conn: Connection object to identify the eventual destination of this input.
+ * iov: Buffers to read into.
+ * iovcnt: Number of buffers.
+ * returns: Same as conn_input().
+ */
+int conn_inputv(conn_t *conn, const struct iovec *iov, int iovcnt);
+
 /**
  * Call on this to send a cTCP segment to a destination associated with the
  * provided connection object.
@@ -87,6 +100,72 @@ int conn_input(conn_t *conn, void *buf, size_t len);
  */
 int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len);
 
+/**
+ * Same as conn_send(), but asks the kernel not to put the segment on the wire
+ * before txtime_us. Only has an effect when the library enabled SO_TXTIME
+ * (see the txtime field of ctcp_config_t); otherwise the segment is sent
+ * immediately. Departures are then enforced by an fq or etf qdisc, so a whole
+ * window can be handed over at once.
+ *
+ * conn: Connection object.
+ * segment: Pointer to cTCP segment to send.
+ * len: Total length of the segment (including the cTCP header and data).
+ * txtime_us: Earliest departure time, on the monotonic_current_time_us()
+ *            clock. 0 means send immediately.
+ *
+ * returns: Same as conn_send().
+ */
+int conn_send_at(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                 int64_t txtime_us);
+
+/** Most SACK blocks one segment carries. Four fill the TCP option space. */
+#define MAX_SACK_BLOCKS 4
+
+/**
+ * A block of data received out of order, from start up to (not including)
+ * end. Relative sequence numbers in host order, like ackno after ntohl().
+ */
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+} ctcp_sack_block_t;
+
+/**
+ * TCP options carried with a segment. A cTCP segment has a fixed header, so
+ * options travel beside it: pass them to conn_send_options() and read those of
+ * a received segment with conn_rx_options(). Fields left at 0 are not sent.
+ */
+typedef struct {
+  uint8_t ack_rate;        /* ACK rate request: the receiver should ACK every
+                              this many full segments. In the library's SYN
+                              and SYN-ACK, the most it will grant. */
+  bool sack_permitted;     /* SACK offered. Only the library's SYN and
+                              SYN-ACK carry it (see the sack field of
+                              ctcp_config_t). */
+  bool timestamps;         /* Timestamps option present (RFC 7323). On the
+                              SYN and SYN-ACK it offers them (see the
+                              timestamps field of ctcp_config_t). */
+  uint32_t ts_val;         /* Sender's timestamp. */
+  uint32_t ts_ecr;         /* Timestamp echoed back to the other host. */
+  uint8_t num_sacks;       /* Number of SACK blocks. */
+  ctcp_sack_block_t sacks[MAX_SACK_BLOCKS]; /* Blocks received past ackno, the
+                              one with the latest segment first (RFC 2018). */
+} ctcp_options_t;
+
+/**
+ * Same as conn_send_at(), but also sends TCP options in the header.
+ *
+ * conn: Connection object.
+ * segment: Pointer to cTCP segment to send.
+ * len: Total length of the segment (including the cTCP header and data).
+ * txtime_us: Earliest departure time, 0 to send immediately.
+ * options: Options to send, or NULL for none.
+ *
+ * returns: Same as conn_send().
+ */
+int conn_send_options(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                      int64_t txtime_us, const ctcp_options_t *options);
+
 /**
  * Call on this to produce output from the segments you have received from the
  * associated connection. This will either write output to STDOUT or to the
@@ -109,6 +188,19 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len);
  */
 int conn_output(conn_t *conn, const char *buf, size_t len);
 
+/**
+ * Like conn_output(), but writes several buffers in order with one writev(),
+ * so data can go out straight from a circular buffer that wraps. Writes as
+ * much as it can right away and queues the rest, up to conn_bufspace() bytes
+ * of it.
+ *
+ * conn: The associated connection object.
+ * iov: Buffers to write out.
+ * iovcnt: Number of buffers.
+ * returns: -1 if error, otherwise the number of bytes written out or queued.
+ */
+int conn_outputv(conn_t *conn, const struct iovec *iov, int iovcnt);
+
 /**
  * Checks how much space is available in STDOUT for output. conn_output() can
  * only write as many bytes as reported by conn_bufspace(). If you write out
@@ -121,6 +213,64 @@ int conn_output(conn_t *conn, const char *buf, size_t len);
  */
 size_t conn_bufspace(conn_t *conn);
 
+/**
+ * Returns the time the kernel received the segment currently being passed to
+ * ctcp_receive(). Use this instead of reading the clock in ctcp_receive() so
+ * RTT and delivery-rate samples do not include event-loop latency.
+ *
+ * conn: The connection object.
+ * returns: Receive time in microseconds on the same clock as
+ *          monotonic_current_time_us(), or 0 if the kernel did not supply a
+ *          timestamp.
+ */
+int64_t conn_rx_time_us(conn_t *conn);
+
+/**
+ * Returns the TCP options of the segment currently being passed to
+ * ctcp_receive(). Options the library does not know are skipped.
+ *
+ * conn: The connection object.
+ * returns: The options. Fields are 0 for options the segment did not carry.
+ */
+const ctcp_options_t *conn_rx_options(conn_t *conn);
+
+/**
+ * Whether the segment being passed to ctcp_receive() is part of a batch that
+ * is still being delivered. If so, the library calls ctcp_output() once the
+ * whole batch is in, so ctcp_receive() can leave output (and the ACKs that go
+ * with it) until then.
+ *
+ * conn: The connection object.
+ * returns: true while a batch is being delivered.
+ */
+bool conn_rx_batch_pending(conn_t *conn);
+
+/**
+ * Hands out the whole input at once when it is a regular file that the
+ * library has mapped into memory (STDIN redirected from a file, or --file).
+ * Segments can then be built straight from the mapping instead of reading.
+ * The mapping stays valid until the program exits, and the input is at EOF
+ * afterwards, so conn_input() returns -1. Input that gets network line endings
+ * is mapped without its trailing \n, and conn_input() then returns the \r\n
+ * before EOF.
+ *
+ * conn: The connection object.
+ * data: Set to the start of the mapping.
+ * returns: Length of the mapping, or -1 if the input is not mapped or has
+ *          already been handed out.
+ */
+ssize_t conn_input_mapped(conn_t *conn, const void **data);
+
+/**
+ * Stops or resumes polling the input for a connection (STDIN, or the
+ * program's output when running one). While input is throttled, ctcp_read()
+ * is not called for it, and whatever is not read stays in the pipe.
+ *
+ * conn: The connection object.
+ * throttled: Whether to stop polling the input.
+ */
+void conn_throttle_input(conn_t *conn, bool throttled);
+
 /**
  * Used to remove a connection object. This is already called on in the starter
  * code in ctcp_destroy(), so you do not need to add calls to it.
@@ -10,13 +10,20 @@
  * this file.
  *****************************************************************************/
 
+#define _GNU_SOURCE   /* recvmmsg() */
 #include <errno.h>
+#include <linux/net_tstamp.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "ctcp_ring.h"
 #include "ctcp_sys_internal.h"
 #include "ctcp_sys.h"
 
@@ -65,6 +72,38 @@ static int opt_corrupt = false;
 static int opt_delay = false;
 static int opt_duplicate = false;
 
+/** Hand departure times to the qdisc with SO_TXTIME instead of pacing in
+    userspace. Needs an fq or etf qdisc on the outgoing interface. */
+static bool opt_txtime = false;
+
+/** Report per-connection counters, such as achieved inter-departure gaps
+    against the pacing target, when a connection closes. */
+static bool opt_conn_stats = false;
+
+/** Hybrid busy-poll receive. While packets keep arriving within this many
+    microseconds of each other, spin on non-blocking receive instead of
+    blocking in poll(). 0 always blocks. */
+static int opt_busy_poll_us = 0;
+
+/** SO_BUSY_POLL value (usec) for the socket, 0 to leave it unset. */
+static int opt_busy_poll_sock_us = 0;
+
+/** Pipelined mode. An I/O thread receives, filters and translates packets and
+    sends translated segments, while the main thread runs the protocol. */
+static bool opt_pipeline = false;
+
+/** Maximum number of packets received and processed as one batch. 1 handles
+    packets one at a time. */
+static int opt_rx_batch = 1;
+
+/** Busy-poll statistics. */
+static struct {
+  uint64_t spins;            /* Loop iterations that spun instead of blocking */
+  uint64_t spin_hits;        /* Spins that found a packet */
+  uint64_t blocks;           /* Loop iterations that blocked in poll() */
+  latency_hist_t ack_turnaround; /* Kernel receive to ACK sent, in usec */
+} busy_poll_stats;
+
 /** For tester, we only do the unreliability once, deterministically. This is
     set to true once it has occurred. */
 static bool tester_did_unreliable = false;
@@ -85,8 +124,8 @@ static int new_connection = 0;
  */
 static struct pollfd *events;
 
-/** When the last timer timeout occurred. */
-static struct timespec last_timeout;
+/** When the last timer timeout occurred, in monotonic microseconds. */
+static int64_t last_timeout_us;
 
 /** Number of clients connected. MAX_NUM_CLIENTS can be connected. */
 static int num_connected = 0;
@@ -96,6 +135,73 @@ static pthread_t thread_main;
 static pthread_t thread_resets;
 static bool handling_resets = false;
 
+/** Report pool allocation counters when a connection closes. */
+static bool opt_alloc_stats = false;
+
+/** Pass input through as is, without network line endings. */
+static bool opt_binary = false;
+
+/** Not-sent low-watermark in bytes. 0 lets cTCP derive it. */
+static uint32_t opt_notsent_lowat = 0;
+
+/** Autocork hold time in microseconds. 0 turns autocork off. */
+static uint32_t opt_autocork_us = AUTOCORK_INTERVAL;
+
+/** Input file given with --file, read instead of STDIN. */
+static char *opt_input_file = NULL;
+
+/** Per-connection and total rate caps in bytes/s. 0 for no cap. */
+static uint64_t opt_max_rate = 0;
+static uint64_t opt_total_rate = 0;
+
+/** Share of the total rate, and whether connections are in the control class. */
+static uint32_t opt_weight = 1;
+static bool opt_priority = false;
+
+/** Weight and class for particular clients, by client port, given with
+    --shape. Other connections get --weight and --priority. */
+static struct {
+  int port;
+  uint32_t weight;
+  bool priority;
+} opt_shapes[MAX_NUM_CLIENTS];
+static int opt_num_shapes = 0;
+
+/** Receive coalescing limits, in segments and bytes. 0 for no limit. */
+static uint32_t opt_gro_segments = 0;
+static uint32_t opt_gro_bytes = GRO_MAX_BYTES;
+
+/** Most full segments per ACK, and longest an ACK is held, in microseconds. */
+static uint32_t opt_ack_frequency = ACK_FREQUENCY_MAX;
+static uint32_t opt_ack_delay_us = DELAYED_ACK_INTERVAL;
+
+/** Offer selective acknowledgements in the handshake. */
+static bool opt_sack = true;
+
+/** Detect loss with RACK-TLP. */
+static bool opt_rack = true;
+
+/** Offer timestamps in the handshake, and use F-RTO after timeouts. Both
+    detect spurious retransmissions. */
+static bool opt_timestamps = true;
+static bool opt_frto = true;
+
+/** Bounds of the retransmission timeout, in microseconds. */
+static uint32_t opt_rto_min_us = RTO_MIN_INTERVAL;
+static uint32_t opt_rto_max_us = RTO_MAX_INTERVAL;
+
+/** Regular-file input mapped into memory, handed out once. */
+static struct {
+  bool tried;       /* Whether mapping the input has been attempted */
+  void *data;       /* The mapping, NULL if the input can't be mapped */
+  size_t len;       /* Length of the mapping */
+  bool tail;        /* Whether the trailing \n is left out of the mapping, to
+                       go out as \r\n afterwards */
+} input_map;
+
+/** Largest single read of terminal-style input in conn_inputv(). */
+#define INPUT_BOUNCE_SIZE 65536
+
 
 /////////////////////////////// HELPER FUNCTIONS //////////////////////////////
 
@@ -156,6 +262,32 @@ int do_config(char *port) {
   config->socket = s;
   config->connections = NULL;
 
+  /* Let the qdisc enforce per-packet departure times. Unix sockets reject
+     SCM_TXTIME, so this only applies to raw sockets. */
+  if (opt_txtime) {
+    struct sock_txtime txtime_cfg = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+    if (unix_socket ||
+        setsockopt(s, SOL_SOCKET, SO_TXTIME, &txtime_cfg,
+                   sizeof(txtime_cfg)) < 0) {
+      fprintf(stderr, "[INFO] SO_TXTIME unavailable, pacing in userspace\n");
+      opt_txtime = false;
+    }
+    ctcp_cfg->txtime = opt_txtime;
+  }
+
+  /* Let the kernel busy-poll the device queue on our behalf as well. */
+  if (opt_busy_poll_sock_us > 0 &&
+      setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &opt_busy_poll_sock_us,
+                 sizeof(opt_busy_poll_sock_us)) < 0) {
+    fprintf(stderr, "[INFO] SO_BUSY_POLL unavailable\n");
+  }
+
+  /* Ask the kernel to timestamp received packets so RTT and delivery-rate
+     samples are not skewed by poll wakeup and processing latency. */
+  int ts_on = 1;
+  if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &ts_on, sizeof(ts_on)) < 0)
+    fprintf(stderr, "[INFO] Kernel receive timestamps unavailable\n");
+
   /* Set up receive timeout. */
   struct timeval tv;
   tv.tv_sec = CONN_TIMEOUT;
@@ -246,6 +378,124 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
 
 ///////////////////////////// PACKETS AND SEGMENTS ////////////////////////////
 
+/**
+ * Length of a TCP header, options included.
+ */
+static int tcp_hdr_len(const tcphdr_t *tcp_hdr) {
+  return MAX(tcp_hdr->th_off * 4, (int) TCP_HDR_SIZE);
+}
+
+/** Writes a 32-bit value in network order. */
+static void put_u32(uint8_t *buf, uint32_t value) {
+  value = htonl(value);
+  memcpy(buf, &value, sizeof(uint32_t));
+}
+
+/** Reads a 32-bit value in network order. */
+static uint32_t get_u32(const uint8_t *buf) {
+  uint32_t value;
+  memcpy(&value, buf, sizeof(uint32_t));
+  return ntohl(value);
+}
+
+/**
+ * Writes TCP options, padded with NOPs to a multiple of 4 bytes. SACK blocks
+ * that don't fit are left out, the last ones first.
+ *
+ * options: The options, or NULL for none.
+ * seq_offset: Added to SACK blocks to turn them into sequence numbers (the
+ *             other host's initial sequence number).
+ * buf: Where to write them. Must have room for TCP_OPT_MAX_SIZE bytes.
+ * returns: Number of bytes written.
+ */
+static int write_tcp_options(const ctcp_options_t *options,
+                             uint32_t seq_offset, uint8_t *buf) {
+  int len = 0;
+  if (options == NULL)
+    return 0;
+
+  if (options->ack_rate > 0) {
+    buf[len++] = TCPOPT_EXPERIMENT;
+    buf[len++] = TCPOLEN_ACK_RATE;
+    buf[len++] = TCPOPT_ACK_RATE_EXID >> 8;
+    buf[len++] = TCPOPT_ACK_RATE_EXID & 0xff;
+    buf[len++] = options->ack_rate;
+  }
+  if (options->timestamps) {
+    buf[len++] = TCPOPT_TIMESTAMP;
+    buf[len++] = TCPOLEN_TIMESTAMP;
+    put_u32(buf + len, options->ts_val);
+    put_u32(buf + len + 4, options->ts_ecr);
+    len += TCPOLEN_TIMESTAMP - 2;
+  }
+  if (options->sack_permitted) {
+    buf[len++] = TCPOPT_SACK_PERMITTED;
+    buf[len++] = TCPOLEN_SACK_PERMITTED;
+  }
+  int num_sacks = MIN(options->num_sacks,
+                      (TCP_OPT_MAX_SIZE - len - 2) / TCPOLEN_SACK_BLOCK);
+  if (num_sacks > 0) {
+    buf[len++] = TCPOPT_SACK;
+    buf[len++] = 2 + num_sacks * TCPOLEN_SACK_BLOCK;
+    int i;
+    for (i = 0; i < num_sacks; i++) {
+      put_u32(buf + len, options->sacks[i].start + seq_offset);
+      put_u32(buf + len + 4, options->sacks[i].end + seq_offset);
+      len += TCPOLEN_SACK_BLOCK;
+    }
+  }
+  while (len % 4 != 0)
+    buf[len++] = TCPOPT_NOP;
+  return len;
+}
+
+/**
+ * Reads the options of a TCP header. Unknown and malformed options are
+ * skipped.
+ *
+ * tcp_hdr: The TCP header.
+ * seq_offset: Subtracted from SACK blocks to turn them into relative sequence
+ *             numbers (this host's initial sequence number).
+ * options: Return parameter. Filled in with the options found.
+ */
+static void parse_tcp_options(const tcphdr_t *tcp_hdr, uint32_t seq_offset,
+                              ctcp_options_t *options) {
+  const uint8_t *opt = (const uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+  const uint8_t *end = (const uint8_t *) tcp_hdr + tcp_hdr_len(tcp_hdr);
+  memset(options, 0, sizeof(ctcp_options_t));
+
+  while (opt < end && opt[0] != TCPOPT_EOL) {
+    if (opt[0] == TCPOPT_NOP) {
+      opt++;
+      continue;
+    }
+    if (end - opt < 2 || opt[1] < 2 || opt[1] > end - opt)
+      break;
+
+    if (opt[0] == TCPOPT_EXPERIMENT && opt[1] == TCPOLEN_ACK_RATE &&
+        ((opt[2] << 8) | opt[3]) == TCPOPT_ACK_RATE_EXID)
+      options->ack_rate = opt[4];
+    else if (opt[0] == TCPOPT_SACK_PERMITTED)
+      options->sack_permitted = true;
+    else if (opt[0] == TCPOPT_TIMESTAMP && opt[1] == TCPOLEN_TIMESTAMP) {
+      options->timestamps = true;
+      options->ts_val = get_u32(opt + 2);
+      options->ts_ecr = get_u32(opt + 6);
+    }
+    else if (opt[0] == TCPOPT_SACK) {
+      int n = MIN((opt[1] - 2) / TCPOLEN_SACK_BLOCK, MAX_SACK_BLOCKS);
+      int i;
+      for (i = 0; i < n; i++) {
+        const uint8_t *block = opt + 2 + i * TCPOLEN_SACK_BLOCK;
+        options->sacks[i].start = get_u32(block) - seq_offset;
+        options->sacks[i].end = get_u32(block + 4) - seq_offset;
+      }
+      options->num_sacks = n;
+    }
+    opt += opt[1];
+  }
+}
+
 /**
  * Creates a TCP RST to a given address (in response to a TCP segment that was
  * sent.
@@ -277,7 +527,8 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
 
 /**
  * Creates a TCP segment (including the IP header). The returned segment must
- * be freed.
+ * be freed. A SYN or SYN-ACK offers SACK and timestamps if they are enabled,
+ * and ACK rate requests.
  *
  * dst: A conn_t containing details for the destination.
  * flags: TCP flags.
@@ -287,14 +538,25 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
  * returns: A TCP segment with the specified fields.
  */
 char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
-  uint16_t tcp_seg_len = TCP_HDR_SIZE + len;
+  ctcp_options_t options;
+  memset(&options, 0, sizeof(ctcp_options_t));
+  options.sack_permitted = (flags & TH_SYN) && ctcp_cfg->sack;
+  options.timestamps = (flags & TH_SYN) && ctcp_cfg->timestamps;
+  if ((flags & TH_SYN) && ctcp_cfg->ack_rate)
+    options.ack_rate = ctcp_cfg->ack_frequency;
+  uint8_t opt_buf[TCP_OPT_MAX_SIZE];
+  uint16_t opt_len = write_tcp_options(&options, 0, opt_buf);
+  uint16_t hdr_len = TCP_HDR_SIZE + opt_len;
+
+  uint16_t tcp_seg_len = hdr_len + len;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_seg_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
 
-  /* Copy data over, if there is any. */
+  /* Copy options and data over, if there are any. */
+  memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE, opt_buf, opt_len);
   if (len > 0 && data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+    char *payload = (char *)((uint8_t *) tcp_hdr + hdr_len);
     memcpy(payload, data, len);
   }
 
@@ -307,13 +569,13 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(dst->next_seqno);
   tcp_hdr->th_ack = htonl(dst->ackno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
+  tcp_hdr->th_off = hdr_len / 4;
   tcp_hdr->th_flags = flags;
   tcp_hdr->th_win = window;
   tcp_hdr->th_sum = 0;
 
   /* TCP checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, len);
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opt_len + len);
 
   /* Update sequence numbers. */
   dst->seqno = dst->next_seqno;
@@ -324,7 +586,8 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
 
 /**
  * Converts a packet from a raw IP packet to a cTCP segment. If there is
- * padding, keep it. The resulting segment must be freed.
+ * padding, keep it. TCP options are not part of the segment (see
+ * parse_tcp_options()). The resulting segment must be freed.
  *
  * src: A conn_t containing connection details of the segment's sender.
  * datagram: The raw IP packet.
@@ -334,10 +597,12 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
 ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
-  char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+  int hdr_len = tcp_hdr_len(tcp_hdr);
+  char *payload = (char *)((uint8_t *) tcp_hdr + hdr_len);
 
-  /* Get actual lengths and allocate cTCP segment of correct size. */
-  uint16_t data_len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE;
+  /* Get actual lengths and allocate cTCP segment. */
+  uint16_t data_len = MIN(MAX(ntohs(ip_hdr->tot_len) - IP_HDR_SIZE - hdr_len,
+                              0), MAX_SEG_DATA_SIZE);
   uint16_t len = data_len + sizeof(ctcp_segment_t);
   ctcp_segment_t *segment = calloc(len, 1);
 
@@ -359,7 +624,7 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
      the student (see convert_to_datagram). */
   uint16_t sum = tcp_hdr->th_sum;
   tcp_hdr->th_sum = 0;
-  uint16_t correct_sum = cksum_tcp(ip_hdr, data_len);
+  uint16_t correct_sum = cksum_tcp(ip_hdr, hdr_len - TCP_HDR_SIZE + data_len);
   segment->cksum += (correct_sum - sum);
   return segment;
 }
@@ -371,19 +636,26 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
  * dst: A conn_t containing connection details of the packet's receiver.
  * segment: The cTCP segment.
  * len: Length of the cTCP segment (including the headers).
+ * options: TCP options to put in the header, or NULL for none.
  * returns: A raw IP packet, NULL if it has an incorrect checksum.
  */
-char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
+char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len,
+                          const ctcp_options_t *options) {
+  uint8_t opt_buf[TCP_OPT_MAX_SIZE];
+  uint16_t opt_len = write_tcp_options(options, dst->their_init_seqno, opt_buf);
+  uint16_t hdr_len = TCP_HDR_SIZE + opt_len;
+
   /* Create IP packet with TCP payload. */
-  uint16_t tcp_pkt_len = len - sizeof(ctcp_segment_t) + TCP_HDR_SIZE;
+  uint16_t tcp_pkt_len = len - sizeof(ctcp_segment_t) + hdr_len;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_pkt_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
 
-  /* Copy data over, if there is any. */
+  /* Copy options and data over, if there are any. */
+  memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE, opt_buf, opt_len);
   uint16_t data_len = len - sizeof(ctcp_segment_t);
   if (data_len > 0 && segment->data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+    char *payload = (char *)((uint8_t *) tcp_hdr + hdr_len);
     memcpy(payload, segment->data, data_len);
   }
 
@@ -392,7 +664,7 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(ntohl(segment->seqno) + dst->init_seqno);
   tcp_hdr->th_ack = htonl(ntohl(segment->ackno) + dst->their_init_seqno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
+  tcp_hdr->th_off = hdr_len / 4;
   tcp_hdr->th_flags = segment->flags;
 
   /* Need to add ACK to all segments if sending it to the web. */
@@ -412,37 +684,51 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
 
   /* TCP checksum. Add on the difference between the correct checksum and the
      student's checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, data_len);
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opt_len + data_len);
   tcp_hdr->th_sum += (correct_sum - sum);
   return datagram;
 }
 
 /**
- * Naive filtering. Host might receive many unwanted packets or leftover
- * packets from a previous session. We drop these packets.
+ * Converts a kernel receive timestamp (CLOCK_REALTIME) to the CLOCK_MONOTONIC
+ * microsecond scale used by monotonic_current_time_us(). This reads the cached
+ * clock, so only the protocol thread may call it.
  *
- * sockfd: Socket file descriptor.
- * buf: Buffer to receive data into.
- * len: Length of buffer and maximum size of data to receive.
- * flags: Flags for recv.
- * rconn: Return parameter. Pointer to the connection state associated with
- *        the sender of the packet.
- *
- * returns: Length of packet if packet wasn't dropped, 0 if no packet
- *          received, and -1 on failure.
+ * ts: Timestamp from an SCM_TIMESTAMPNS control message, zero if none.
+ * returns: The timestamp in monotonic microseconds, 0 if there is none.
  */
-int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
-  int r = recv(sockfd, buf, len, flags);
-  if (r < 0)
-    return -1;
+int64_t rx_timestamp_to_monotonic_us(const struct timespec *ts) {
+  if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+    return 0;
+  return time_realtime_to_monotonic_us(ts->tv_sec * 1000000ll +
+                                       ts->tv_nsec / 1000);
+}
 
+/**
+ * Decides whether a received packet is for us and which connection it belongs
+ * to.
+ *
+ * buf: The raw packet.
+ * r: Length of the packet.
+ * rconn: Return parameter. Connection the packet belongs to, left untouched
+ *        for SYNs and dropped packets.
+ * returns: r if the packet should be processed, 0 if it should be dropped.
+ */
+int packet_filter(char *buf, int r, conn_t **rconn) {
   if (r < FULL_HDR_SIZE)
     return 0;
 
   /* Is this packet to us? If not, ignore it. */
   iphdr_t *ip_hdr = (iphdr_t *) buf;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-  if (tcp_hdr->th_dport != htons(config->port))
+  if (tcp_hdr->th_dport != htons(config->port) ||
+      r < IP_HDR_SIZE + tcp_hdr_len(tcp_hdr))
+    return 0;
+
+  /* More data than a cTCP segment holds, or a length that disagrees with the
+     IP header. The segment would not match the length passed on with it. */
+  if (ntohs(ip_hdr->tot_len) != r ||
+      r - IP_HDR_SIZE - tcp_hdr_len(tcp_hdr) > MAX_SEG_DATA_SIZE)
     return 0;
 
   /* A RST packet. End connection. */
@@ -477,17 +763,75 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
 }
 
 /**
- * Sends a packet out through the appropriate socket.
+ * Pulls the kernel receive timestamp out of a received message. It is left on
+ * the kernel's clock, so the I/O thread can call this too.
+ *
+ * msg: The message, as filled in by recvmsg() or recvmmsg().
+ * ts: Return parameter. Receive time (CLOCK_REALTIME), zero if there is none.
+ */
+void rx_timestamp_from_msg(struct msghdr *msg, struct timespec *ts) {
+  struct cmsghdr *cmsg;
+  memset(ts, 0, sizeof(*ts));
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(ts, CMSG_DATA(cmsg), sizeof(*ts));
+      return;
+    }
+  }
+}
+
+/**
+ * Naive filtering. Host might receive many unwanted packets or leftover
+ * packets from a previous session. We drop these packets.
+ *
+ * sockfd: Socket file descriptor.
+ * buf: Buffer to receive data into.
+ * len: Length of buffer and maximum size of data to receive.
+ * flags: Flags for recv.
+ * rconn: Return parameter. Pointer to the connection state associated with
+ *        the sender of the packet.
+ * rx_ts: Return parameter. Kernel receive timestamp of the packet, as
+ *        rx_timestamp_from_msg() returns it. May be NULL.
+ *
+ * returns: Length of packet if packet wasn't dropped, 0 if no packet
+ *          received, and -1 on failure.
+ */
+int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn,
+                struct timespec *rx_ts) {
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  int r = recvmsg(sockfd, &msg, flags);
+  if (r < 0)
+    return -1;
+
+  if (rx_ts != NULL)
+    rx_timestamp_from_msg(&msg, rx_ts);
+  return packet_filter(buf, r, rconn);
+}
+
+/**
+ * Sends a packet out through the appropriate socket, optionally with an
+ * earliest departure time for the qdisc.
  *
  * dst: Destination connection object.
  * sockfd: Socket file descriptor.
  * buf: Data to send.
  * len: Length of data.
- * flags: Flags for sendto.
+ * flags: Flags for sendmsg.
+ * txtime_us: Departure time in monotonic microseconds. 0 sends immediately.
  *
  * returns: Number of bytes actually sent, or -1 if error.
  */
-int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
+int send_pkt_at(conn_t *dst, int sockfd, const void *buf, size_t len,
+                int flags, int64_t txtime_us) {
   struct sockaddr *addr;
   size_t size;
 
@@ -501,7 +845,45 @@ int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
     size = sizeof(dst->saddr);
   }
 
-  return sendto(config->socket, buf, len, flags, addr, size);
+  if (txtime_us == 0)
+    return sendto(config->socket, buf, len, flags, addr, size);
+
+  /* Attach the departure time as an SCM_TXTIME control message. */
+  char control[CMSG_SPACE(sizeof(uint64_t))];
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_name = addr;
+  msg.msg_namelen = size;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  uint64_t txtime_ns = (uint64_t) txtime_us * 1000;
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  memcpy(CMSG_DATA(cmsg), &txtime_ns, sizeof(txtime_ns));
+
+  return sendmsg(config->socket, &msg, flags);
+}
+
+/**
+ * Sends a packet out through the appropriate socket.
+ *
+ * dst: Destination connection object.
+ * sockfd: Socket file descriptor.
+ * buf: Data to send.
+ * len: Length of data.
+ * flags: Flags for sendto.
+ *
+ * returns: Number of bytes actually sent, or -1 if error.
+ */
+int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
+  return send_pkt_at(dst, sockfd, buf, len, flags, 0);
 }
 
 /**
@@ -532,7 +914,7 @@ void *send_resets(void *args) {
     int s = sendto(config->socket, rst, FULL_HDR_SIZE, 0,
                    (struct sockaddr *) &conn.saddr, sizeof(conn.saddr));
     memset(buf, 0, MAX_PACKET_SIZE);
-    free(rst);
+    datagram_free(rst);
 
     /* Could not send resets. Give up. */
     if (s < 0)
@@ -557,8 +939,9 @@ void *send_resets(void *args) {
  */
 int send_tcp_conn_seg(conn_t *dst, int flags) {
   char *tcp_pkt = create_tcp_seg(dst, flags, NULL, 0);
-  int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE, 0);
-  free(tcp_pkt);
+  int r = send_pkt(dst, config->socket, tcp_pkt,
+                   ntohs(((iphdr_t *) tcp_pkt)->tot_len), 0);
+  datagram_free(tcp_pkt);
 
   if (r < 0) {
     fprintf(stderr, "[ERROR] Could not connect\n");
@@ -580,6 +963,263 @@ inline int send_synack(conn_t *dst) {
 }
 
 
+//////////////////////////////// BATCHED RECEIVE //////////////////////////////
+
+/** Largest batch that can be asked for with --rx-batch. */
+#define RX_BATCH_MAX 32
+
+/** A batch of received packets. Each stage of the receive path runs over the
+    whole batch before the next stage starts, so the code and the state for
+    one stage stay hot in cache. */
+static struct {
+  bool active;                 /* Delivering a batch to student code */
+  int count;                   /* Packets in the batch */
+  char bufs[RX_BATCH_MAX][MAX_PACKET_SIZE];   /* Raw packets */
+  int lens[RX_BATCH_MAX];      /* Packet lengths, 0 once dropped */
+  int64_t rx_time_us[RX_BATCH_MAX];           /* Kernel receive timestamps */
+  conn_t *conns[RX_BATCH_MAX]; /* Owning connection, NULL for SYNs */
+  ctcp_segment_t *segments[RX_BATCH_MAX];     /* Translated segments */
+  int num_touched;             /* Connections that got segments */
+  conn_t *touched[RX_BATCH_MAX];
+} rx_batch;
+
+/**
+ * Starts delivering a batch. Until rx_batch_end(), student code is told (via
+ * conn_rx_batch_pending()) that ctcp_output() will be called once the whole
+ * batch is in, so it can defer per-connection work.
+ */
+void rx_batch_begin() {
+  rx_batch.active = true;
+  rx_batch.num_touched = 0;
+}
+
+/**
+ * Remembers that a connection got a segment in the current batch.
+ */
+void rx_batch_touch(conn_t *conn) {
+  int i;
+  if (!rx_batch.active)
+    return;
+  for (i = 0; i < rx_batch.num_touched; i++) {
+    if (rx_batch.touched[i] == conn)
+      return;
+  }
+  if (rx_batch.num_touched < RX_BATCH_MAX)
+    rx_batch.touched[rx_batch.num_touched++] = conn;
+}
+
+
+///////////////////////////////// PIPELINED I/O ///////////////////////////////
+
+/** Number of packets that can be in flight between the two threads, in each
+    direction. */
+#define PIPELINE_RING_SIZE 256
+
+/** A received packet handed from the I/O thread to the protocol thread. */
+typedef struct {
+  conn_t *conn;                /* Connection, or NULL for a new connection */
+  ctcp_segment_t *segment;     /* Translated segment, NULL if conn is NULL */
+  int len;                     /* Length of the raw packet */
+  struct timespec rx_ts;       /* Kernel receive timestamp, unconverted:
+                                  the clock belongs to the protocol thread */
+  char buf[MAX_PACKET_SIZE];   /* The raw packet */
+} rx_item_t;
+
+/** A segment handed from the protocol thread to the I/O thread to send. */
+typedef struct {
+  conn_t *conn;                /* Connection to send on */
+  int len;                     /* Length of the cTCP segment */
+  int64_t txtime_us;           /* Earliest departure time, 0 for none */
+  ctcp_options_t options;      /* TCP options to send with it */
+  char buf[MAX_PACKET_SIZE];   /* The cTCP segment */
+} tx_item_t;
+
+/** State shared by the I/O thread and the protocol thread. Items circulate
+    between a work ring and a free ring, so neither thread allocates. */
+static struct {
+  bool running;                /* Whether the I/O thread has been started */
+  pthread_t thread;
+  spsc_ring_t *rx_ring;        /* Received packets, I/O -> protocol */
+  spsc_ring_t *rx_free;        /* Free rx items, protocol -> I/O */
+  spsc_ring_t *tx_ring;        /* Segments to send, protocol -> I/O */
+  spsc_ring_t *tx_free;        /* Free tx items, I/O -> protocol */
+  rx_item_t *rx_spare;         /* Free rx item the I/O thread holds on to */
+  int rx_event;                /* Signalled when rx_ring has packets */
+  int tx_event;                /* Signalled when tx_ring has segments */
+  pthread_mutex_t conn_lock;   /* Held while the connection list is used by
+                                  the I/O thread or changed by the protocol
+                                  thread */
+} pipeline = { .conn_lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * [I/O thread] Sends every segment queued by the protocol thread. Must be
+ * called with conn_lock held.
+ */
+void pipeline_send_pending() {
+  tx_item_t *item;
+  while ((item = spsc_ring_pop(pipeline.tx_ring)) != NULL) {
+    ctcp_segment_t *segment = (ctcp_segment_t *) item->buf;
+    char *pkt = convert_to_datagram(item->conn, segment, item->len,
+                                    &item->options);
+    uint16_t total_len = ntohs(((iphdr_t *) pkt)->tot_len);
+    send_pkt_at(item->conn, config->socket, pkt, total_len, 0,
+                item->txtime_us);
+    datagram_free(pkt);
+    spsc_ring_push(pipeline.tx_free, item);
+  }
+}
+
+/**
+ * [I/O thread] Receives every packet waiting on the socket, as long as there
+ * are free items to put them in, and queues them for the protocol thread.
+ * Must be called with conn_lock held.
+ *
+ * returns: The number of packets queued.
+ */
+int pipeline_receive_pending() {
+  int queued = 0;
+
+  while (true) {
+    rx_item_t *item = pipeline.rx_spare;
+    if (item == NULL)
+      item = spsc_ring_pop(pipeline.rx_free);
+    if (item == NULL)
+      break;
+    pipeline.rx_spare = item;
+
+    item->conn = NULL;
+    item->segment = NULL;
+    int len = recv_filter(config->socket, item->buf, MAX_PACKET_SIZE,
+                          MSG_DONTWAIT, &item->conn, &item->rx_ts);
+    if (len < 0)
+      break;
+    if (len < FULL_HDR_SIZE)
+      continue;
+
+    /* Translate here so the protocol thread only runs the protocol. */
+    item->len = len;
+    if (item->conn != NULL)
+      item->segment = convert_to_ctcp(item->conn, item->buf, len);
+
+    /* There are as many items as ring slots, so this cannot fail. */
+    spsc_ring_push(pipeline.rx_ring, item);
+    pipeline.rx_spare = NULL;
+    queued++;
+  }
+  return queued;
+}
+
+/**
+ * [I/O thread] Main loop of the I/O thread.
+ */
+void *pipeline_io_thread(void *args) {
+  struct pollfd fds[2];
+  fds[0].fd = config->socket;
+  fds[1].fd = pipeline.tx_event;
+  fds[1].events = POLLIN;
+
+  while (true) {
+    /* Only watch the socket if there is somewhere to put a packet. Otherwise
+       check back shortly for items the protocol thread has returned. */
+    bool can_receive = pipeline.rx_spare != NULL ||
+                       !spsc_ring_empty(pipeline.rx_free);
+    fds[0].events = can_receive ? POLLIN : 0;
+    fds[0].revents = fds[1].revents = 0;
+    poll(fds, 2, can_receive ? -1 : 1);
+
+    if (fds[1].revents & POLLIN) {
+      eventfd_t count;
+      eventfd_read(pipeline.tx_event, &count);
+    }
+
+    pthread_mutex_lock(&pipeline.conn_lock);
+    pipeline_send_pending();
+    int queued = can_receive ? pipeline_receive_pending() : 0;
+    pthread_mutex_unlock(&pipeline.conn_lock);
+
+    if (queued > 0)
+      eventfd_write(pipeline.rx_event, 1);
+  }
+  return NULL;
+}
+
+/**
+ * Starts the I/O thread. From then on the main thread polls rx_event instead
+ * of the socket.
+ */
+void pipeline_start() {
+  int i;
+  pipeline.rx_ring = spsc_ring_create(PIPELINE_RING_SIZE);
+  pipeline.rx_free = spsc_ring_create(PIPELINE_RING_SIZE);
+  pipeline.tx_ring = spsc_ring_create(PIPELINE_RING_SIZE);
+  pipeline.tx_free = spsc_ring_create(PIPELINE_RING_SIZE);
+  for (i = 0; i < PIPELINE_RING_SIZE; i++) {
+    spsc_ring_push(pipeline.rx_free, calloc(sizeof(rx_item_t), 1));
+    spsc_ring_push(pipeline.tx_free, calloc(sizeof(tx_item_t), 1));
+  }
+
+  pipeline.rx_event = eventfd(0, EFD_NONBLOCK);
+  pipeline.tx_event = eventfd(0, EFD_NONBLOCK);
+  if (pipeline.rx_event < 0 || pipeline.tx_event < 0 ||
+      pthread_create(&pipeline.thread, NULL, pipeline_io_thread, NULL) != 0) {
+    fprintf(stderr, "[ERROR] Could not start the I/O thread\n");
+    exit(EXIT_FAILURE);
+  }
+  pipeline.running = true;
+  fprintf(stderr, "[INFO] Pipelined I/O enabled\n");
+}
+
+/**
+ * [Protocol thread] Queues a segment for the I/O thread to send.
+ *
+ * conn: Connection to send on.
+ * segment: The cTCP segment, in network order.
+ * len: Length of the segment.
+ * txtime_us: Earliest departure time, 0 for none.
+ * options: TCP options to send with it, or NULL for none.
+ * returns: true if the segment was queued, false if the caller must send it
+ *          itself (pipelining is off or the ring is full).
+ */
+bool pipeline_enqueue_send(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                           int64_t txtime_us, const ctcp_options_t *options) {
+  if (!pipeline.running || len > MAX_PACKET_SIZE)
+    return false;
+
+  tx_item_t *item = spsc_ring_pop(pipeline.tx_free);
+  if (item == NULL)
+    return false;
+
+  item->conn = conn;
+  item->len = len;
+  item->txtime_us = txtime_us;
+  if (options != NULL)
+    item->options = *options;
+  else
+    memset(&item->options, 0, sizeof(ctcp_options_t));
+  memcpy(item->buf, segment, len);
+  spsc_ring_push(pipeline.tx_ring, item);
+  eventfd_write(pipeline.tx_event, 1);
+  return true;
+}
+
+/**
+ * [Protocol thread] Waits until the I/O thread has sent everything queued so
+ * far. Needed before a connection is freed and before the process exits.
+ */
+void pipeline_flush() {
+  if (!pipeline.running)
+    return;
+
+  while (!spsc_ring_empty(pipeline.tx_ring))
+    sched_yield();
+
+  /* The I/O thread sends under the lock, so once we get it, the last
+     segment it popped is out. */
+  pthread_mutex_lock(&pipeline.conn_lock);
+  pthread_mutex_unlock(&pipeline.conn_lock);
+}
+
+
 ////////////////////// CONNECTIONS AND SENDING/RECEIVING //////////////////////
 
 /**
@@ -589,6 +1229,7 @@ inline int send_synack(conn_t *dst) {
  * conn: The new conn_t to add.
  */
 void conn_add(conn_t *conn) {
+  pthread_mutex_lock(&pipeline.conn_lock);
   conn_t *conn_list = get_connections();
 
   if (conn != conn_list) {
@@ -598,12 +1239,12 @@ void conn_add(conn_t *conn) {
     if (conn_list)
       conn_list->prev = &conn->next;
   }
-  conn->out_queue_tail = &conn->out_queue;
 
   if (SERVER)
     config->connections = conn;
   else
     config->sconn = conn;
+  pthread_mutex_unlock(&pipeline.conn_lock);
 }
 
 /**
@@ -614,14 +1255,59 @@ void conn_add(conn_t *conn) {
  * returns: The number of bytes that can be written out.
  */
 size_t conn_bufspace(conn_t *conn) {
-  chunk_t *chunk;
-  size_t used = 0;
+  return MAX_BUF_SPACE - conn->out_len;
+}
+
+/**
+ * Returns the queued output as up to two regions of the output ring.
+ *
+ * conn: The connection object.
+ * iov: Filled in with the regions.
+ * returns: The number of regions, 0 if nothing is queued.
+ */
+static int output_regions(conn_t *conn, struct iovec iov[2]) {
+  if (conn->out_len == 0)
+    return 0;
+  uint32_t first = MIN(conn->out_len, MAX_BUF_SPACE - conn->out_start);
+  iov[0].iov_base = conn->out_ring + conn->out_start;
+  iov[0].iov_len = first;
+  if (first == conn->out_len)
+    return 1;
+  iov[1].iov_base = conn->out_ring;
+  iov[1].iov_len = conn->out_len - first;
+  return 2;
+}
 
-  /* Count up how much output space already used. */
-  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
-    used += (chunk->size - chunk->used);
+/**
+ * Queues output behind what is in the output ring, as much as fits.
+ *
+ * conn: The connection object.
+ * iov: Buffers holding the output.
+ * iovcnt: Number of buffers.
+ * skip: Bytes at the front of the buffers that were already written.
+ * returns: The number of bytes queued.
+ */
+static size_t queue_output(conn_t *conn, const struct iovec *iov, int iovcnt,
+                           size_t skip) {
+  size_t queued = 0;
+  int i;
+  for (i = 0; i < iovcnt && conn->out_len < MAX_BUF_SPACE; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    const char *buf = (const char *) iov[i].iov_base + skip;
+    size_t len = MIN(iov[i].iov_len - skip, MAX_BUF_SPACE - conn->out_len);
+    skip = 0;
+
+    uint32_t off = (conn->out_start + conn->out_len) & (MAX_BUF_SPACE - 1);
+    uint32_t first = MIN(len, MAX_BUF_SPACE - off);
+    memcpy(conn->out_ring + off, buf, first);
+    memcpy(conn->out_ring, buf + first, len - first);
+    conn->out_len += len;
+    queued += len;
   }
-  return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
+  return queued;
 }
 
 /**
@@ -630,8 +1316,9 @@ size_t conn_bufspace(conn_t *conn) {
  * conn: Associated connection object.
  */
 void conn_drain(conn_t *conn) {
-  chunk_t *chunk;
-  int w;
+  struct iovec iov[2];
+  int iovcnt;
+  ssize_t w;
   bool outputted = false;
   events[STDOUT_FILENO].events &= ~POLLOUT;
 
@@ -639,39 +1326,27 @@ void conn_drain(conn_t *conn) {
   if (conn->wrote_err)
     return;
 
-  /* Drain the output queue. Output as many chunks as possible. */
-  while ((chunk = conn->out_queue)) {
-    if (run_program)
-      w = write(conn->stdin, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-    else
-      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-
+  /* Drain the output ring. Both regions go out in one writev(). */
+  if ((iovcnt = output_regions(conn, iov)) > 0) {
+    w = writev(run_program ? conn->stdin : STDOUT_FILENO, iov, iovcnt);
     if (w < 0) {
       if (errno != EAGAIN)
         conn->wrote_err = true;
-      break;
     }
-    outputted = true;
-    chunk->used += w;
+    else {
+      outputted = true;
+      conn->out_start = (conn->out_start + w) & (MAX_BUF_SPACE - 1);
+      conn->out_len -= w;
 
-    /* Could not complete one chunk. Stop after this. */
-    if (chunk->used < chunk->size) {
-      events[STDOUT_FILENO].events |= POLLOUT;
-      break;
+      /* Could not write it all. Wait until there is room. */
+      if (conn->out_len > 0)
+        events[STDOUT_FILENO].events |= POLLOUT;
     }
-    conn->out_queue = chunk->next;
-
-    /* Update pointers. */
-    if (!conn->out_queue)
-      conn->out_queue_tail = &conn->out_queue;
-    free(chunk);
   }
 
   /* Error in outputting if already wrote EOF but still stuff in the output
      queue. */
-  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue)
+  if (conn->wrote_eof && !conn->wrote_err && conn->out_len == 0)
     conn->wrote_err = true;
 
   /* Output queue has space. Call student code. */
@@ -685,14 +1360,27 @@ void conn_drain(conn_t *conn) {
  * conn: The conn_t to free.
  */
 void conn_free(conn_t *conn) {
-  /* Free up chunks. */
-  chunk_t *chunk, *next_chunk;
-  for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
-    next_chunk = chunk->next;
-    free(chunk);
+  /* Show that the per-packet objects came from the pools. */
+  if (opt_alloc_stats)
+    pool_report();
+
+  /* Report busy-poll effectiveness. */
+  if (opt_busy_poll_us > 0) {
+    uint64_t spins = busy_poll_stats.spins;
+    fprintf(stderr, "[INFO] Busy-poll: %lu spins (%.1f%% hit), %lu blocking "
+            "polls, ACK turnaround p50 %lu us, p99 %lu us (%lu ACKs)\n",
+            spins, spins ? 100.0 * busy_poll_stats.spin_hits / spins : 0.0,
+            busy_poll_stats.blocks,
+            hist_percentile(&busy_poll_stats.ack_turnaround, 50),
+            hist_percentile(&busy_poll_stats.ack_turnaround, 99),
+            busy_poll_stats.ack_turnaround.count);
   }
 
+  /* The I/O thread may still hold segments for this connection. */
+  pipeline_flush();
+
   /* Adjust pointers. */
+  pthread_mutex_lock(&pipeline.conn_lock);
   if (conn->next)
     conn->next->prev = conn->prev;
   if (conn->prev)
@@ -704,6 +1392,7 @@ void conn_free(conn_t *conn) {
     else
       config->sconn = NULL;
   }
+  pthread_mutex_unlock(&pipeline.conn_lock);
 
   /* Close pipes to program, if it's running. */
   if (run_program) {
@@ -713,6 +1402,38 @@ void conn_free(conn_t *conn) {
   free(conn);
 }
 
+/**
+ * Works out what a read of input returned: EOF (in tester mode, the EOF
+ * character also counts), no input yet, or some bytes.
+ *
+ * conn: The connection object.
+ * r: What read()/readv() returned.
+ * first: First byte read, if any.
+ * returns: What conn_input() returns.
+ */
+static int input_result(conn_t *conn, int r, char first) {
+  /* Received EOF. In tester mode, we let the EOF character represent an EOF. */
+  if (r == 0 || (r < 0 && errno != EAGAIN) ||
+      ((test_debug_on || lab5_mode) && r > 0 && first == 0x1a)) {
+    conn->read_eof = true;
+    return -1;
+  }
+  /* No input. */
+  else if (r < 0 && errno == EAGAIN) {
+    r = 0;
+  }
+
+  return r;
+}
+
+/**
+ * Whether input is passed through byte for byte. Only terminal-style input
+ * gets network line endings.
+ */
+static bool input_is_raw() {
+  return run_program || unix_socket || opt_binary;
+}
+
 /**
  * Reads input that then needs to be put into segments to send off. Reads up to
  * to len bytes.
@@ -738,36 +1459,191 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
     return -1;
   }
 
+  /* The line ending held back from a mapped input file, and then EOF. */
+  if (conn->input_tail) {
+    if (len < 2)
+      return 0;
+    memcpy(buf, "\r\n", 2);
+    conn->input_tail = false;
+    conn->read_eof = true;
+    return 2;
+  }
+
   /* Read from the appropriate place (STOUT of the associated program). */
   if (run_program)
     r = read(conn->stdout, buf, len);
-  else if (unix_socket)
+  else if (input_is_raw())
     r = read(STDIN_FILENO, buf, len);
-  /* Add network-line endings if needed. */
+  /* Add network-line endings if needed. Leave room for the byte the line
+     ending grows by and the terminator after it. */
   else {
-    r = read(STDIN_FILENO, buf, len - 1);
-    if (r > 0) {
-      if (add_network_line_ending(!unix_socket, buf, r))
-        r += 1;
-      else
-        r += read(STDIN_FILENO, buf + r, 1);
-    }
+    if (len < 3)
+      return 0;
+    r = read(STDIN_FILENO, buf, len - 2);
+    if (r > 0 && add_network_line_ending(!unix_socket, buf, r))
+      r += 1;
   }
 
-  /* Received EOF. In tester mode, we let the EOF character represent an EOF. */
-  if (r == 0 || (r < 0 && errno != EAGAIN) ||
-      ((test_debug_on || lab5_mode) && r > 0 && ((char *) buf)[0] == 0x1a)) {
-    conn->read_eof = true;
+  return input_result(conn, r, r > 0 ? ((char *) buf)[0] : 0);
+}
+
+/**
+ * Scatter version of conn_input(). Raw input is read straight into the
+ * buffers with one readv(); otherwise it goes through conn_input() and is
+ * copied out.
+ *
+ * conn: The connection object.
+ * iov: Buffers to read into, filled in order.
+ * iovcnt: Number of buffers.
+ * returns: Same as conn_input().
+ */
+int conn_inputv(conn_t *conn, const struct iovec *iov, int iovcnt) {
+  ASSERT_CONN;
+  if (conn == NULL || iov == NULL || iovcnt <= 0) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_inputv\n");
     return -1;
   }
-  /* No input. */
-  else if (r < 0 && errno == EAGAIN) {
-    r = 0;
+  if (conn->read_eof)
+    return -1;
+
+  if (input_is_raw()) {
+    int fd = run_program ? conn->stdout : STDIN_FILENO;
+    int r = readv(fd, iov, iovcnt);
+    return input_result(conn, r,
+                        r > 0 ? ((char *) iov[0].iov_base)[0] : 0);
   }
 
+  size_t len = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  char buf[INPUT_BOUNCE_SIZE];
+  int r = conn_input(conn, buf, MIN(len, sizeof(buf)));
+  size_t off = 0;
+  for (i = 0; i < iovcnt && off < (size_t) MAX(r, 0); i++) {
+    size_t n = MIN(iov[i].iov_len, r - off);
+    memcpy(iov[i].iov_base, buf + off, n);
+    off += n;
+  }
   return r;
 }
 
+/**
+ * Maps STDIN if it is a regular file. Files too large for the 32-bit sequence
+ * space are read instead. If the input gets network line endings, its trailing
+ * \n is held back and conn_input() hands it out as \r\n, as it would have
+ * for a single read of the whole file.
+ */
+static void map_input() {
+  input_map.tried = true;
+  struct stat st;
+  if (run_program || fstat(STDIN_FILENO, &st) < 0 ||
+      !S_ISREG(st.st_mode) || st.st_size == 0)
+    return;
+  if ((uint64_t) st.st_size >= UINT32_MAX / 2) {
+    fprintf(stderr, "[INFO] Input file too large to map, reading it\n");
+    return;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+  if (data == MAP_FAILED) {
+    perror("[ERROR] mmap input");
+    return;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  input_map.data = data;
+  input_map.len = st.st_size;
+  if (!input_is_raw() && ((char *) data)[st.st_size - 1] == '\n') {
+    input_map.tail = true;
+    input_map.len--;
+  }
+}
+
+ssize_t conn_input_mapped(conn_t *conn, const void **data) { ASSERT_CONN;
+  if (!input_map.tried)
+    map_input();
+  if (input_map.data == NULL || conn->read_eof || conn->input_tail)
+    return -1;
+
+  /* The whole file is handed out at once, so the input is now at EOF unless a
+     line ending is still to come from conn_input(). */
+  *data = input_map.data;
+  conn->input_tail = input_map.tail;
+  conn->read_eof = !input_map.tail;
+  return input_map.len;
+}
+
+void conn_throttle_input(conn_t *conn, bool throttled) { ASSERT_CONN;
+  conn->input_throttled = throttled;
+}
+
+/**
+ * Sets which inputs are polled. Server STDIN goes to the most recently
+ * connected client, so it follows that connection's throttle. A throttled
+ * input is left out by its fd: poll() reports a hung-up pipe whatever the
+ * events asked for.
+ */
+static void update_input_polling() {
+  conn_t *conn = get_connections();
+  if (!run_program) {
+    bool throttled = conn != NULL && conn->input_throttled;
+    events[STDIN_FILENO].fd = throttled ? -1 : STDIN_FILENO;
+    return;
+  }
+  for (; conn != NULL; conn = conn->next) {
+    if (conn->poll_fd != NULL)
+      conn->poll_fd->fd = conn->input_throttled ? -1 : conn->stdout;
+  }
+}
+
+/**
+ * Blocks until something happens, ctcp_timer() is due or the earliest paced
+ * departure comes up. Unlike poll(), ppoll() takes a timeout finer than a
+ * millisecond, which pacing needs.
+ *
+ * nfds: Number of entries in events.
+ */
+static void poll_until_next_event(int nfds) {
+  int64_t wait_us = (int64_t)need_timer_in(last_timeout_us, ctcp_cfg->timer) * 1000;
+  uint64_t departure_us = ctcp_next_departure_us();
+  if (departure_us != 0) {
+    int64_t until_us = (int64_t)departure_us - time_read_us();
+    wait_us = MAX(MIN(wait_us, until_us), 0);
+  }
+
+  struct timespec timeout;
+  timeout.tv_sec = wait_us / 1000000;
+  timeout.tv_nsec = (wait_us % 1000000) * 1000;
+  ppoll(events, nfds, &timeout, NULL);
+}
+
+/**
+ * Returns the kernel receive timestamp of the segment currently being passed
+ * to ctcp_receive().
+ *
+ * conn: The connection object.
+ * returns: Receive time in monotonic microseconds, or 0 if unavailable.
+ */
+int64_t conn_rx_time_us(conn_t *conn) {
+  return conn->rx_time_us;
+}
+
+/**
+ * Returns the TCP options of the segment currently being passed to
+ * ctcp_receive().
+ *
+ * conn: The connection object.
+ * returns: The options, 0 for those the segment did not carry.
+ */
+const ctcp_options_t *conn_rx_options(conn_t *conn) {
+  return &conn->rx_options;
+}
+
+bool conn_rx_batch_pending(conn_t *conn) {
+  return rx_batch.active;
+}
+
 /**
  * Schedules a connection object for removal.
  *
@@ -785,24 +1661,57 @@ void conn_remove(conn_t *conn) {
 
 /**
  * Sends a cTCP segment to a destination associated with the provided
- * connection object.
+ * connection object, to leave no earlier than the given departure time.
+ *
+ * conn: Connection object.
+ * segment: Pointer to cTCP segment to send.
+ * len: Length of the segment (including the cTCP header and data).
+ * txtime_us: Earliest departure time in monotonic microseconds, or 0 to send
+ *            immediately. Ignored unless SO_TXTIME is enabled.
+ *
+ * returns: The number of bytes actually sent, 0 if nothing was sent, -1 if
+ *          there in an error.
+ */
+int conn_send_at(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                 int64_t txtime_us) {
+  return conn_send_options(conn, segment, len, txtime_us, NULL);
+}
+
+/**
+ * Sends a cTCP segment with TCP options in its header.
  *
  * conn: Connection object.
  * segment: Pointer to cTCP segment to send.
  * len: Length of the segment (including the cTCP header and data).
+ * txtime_us: Earliest departure time, 0 to send immediately.
+ * options: TCP options, or NULL for none.
  *
  * returns: The number of bytes actually sent, 0 if nothing was sent, -1 if
  *          there in an error.
  */
-int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
+int conn_send_options(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                      int64_t txtime_us, const ctcp_options_t *options) {
+  ASSERT_CONN;
   /* Check parameters. */
   if (conn == NULL || segment == NULL) {
     fprintf(stderr, "[ERROR] NULL parameters in conn_send\n");
     return -1;
   }
 
+  /* Time from the kernel receiving a segment to us acknowledging it. */
+  if (opt_busy_poll_us > 0 && len == sizeof(ctcp_segment_t) &&
+      (segment->flags & TH_ACK) && conn->rx_time_us > 0) {
+    int64_t turnaround_us = time_read_us() - conn->rx_time_us;
+    hist_add(&busy_poll_stats.ack_turnaround, MAX(turnaround_us, 0));
+  }
+
   /* Make a copy of the segment first. */
-  ctcp_segment_t *segment_copy = calloc(len, 1);
+  char copy_buf[MAX_PACKET_SIZE];
+  if (len > sizeof(copy_buf)) {
+    fprintf(stderr, "[ERROR] Segment too large in conn_send\n");
+    return -1;
+  }
+  ctcp_segment_t *segment_copy = (ctcp_segment_t *) copy_buf;
   memcpy(segment_copy, segment, len);
 
   /* Fork process off in order to do unreliability. Keep track of whether we
@@ -819,7 +1728,6 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
       fprintf(stderr, "[DEBUG] Dropping segment\n");
       print_hdr_ctcp(segment_copy);
     }
-    free(segment_copy);
     return len;
   }
 
@@ -856,7 +1764,6 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     }
     /* Original process. */
     else {
-      free(segment_copy);
       return len;
     }
   }
@@ -879,23 +1786,26 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
     flipbit(segment_copy, rand_bit);
   }
 
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
-  uint16_t total_len = FULL_HDR_SIZE + data_len;
-
   if (log_file != -1 || test_debug_on) {
     log_segment(log_file, config->ip_addr, config->port, conn, segment_copy,
                 len, true, unix_socket);
   }
 
+  /* In pipelined mode the I/O thread translates and sends the segment. */
+  if (!am_i_forked && pipeline_enqueue_send(conn, segment_copy, len,
+                                            txtime_us, options))
+    return len;
+
   /* Convert from a cTCP segment to a real one and finally send the segment. */
-  char *pkt = convert_to_datagram(conn, segment_copy, len);
-  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  char *pkt = convert_to_datagram(conn, segment_copy, len, options);
+  uint16_t total_len = ntohs(((iphdr_t *) pkt)->tot_len);
+  int n = send_pkt_at(conn, config->socket, pkt, total_len, 0,
+                      opt_txtime ? txtime_us : 0);
   if (DEBUG) {
     fprintf(stderr, "[DEBUG] Sent segment\n");
     print_hdr_ctcp(segment_copy);
   }
-  free(pkt);
-  free(segment_copy);
+  datagram_free(pkt);
 
   /* Kill forked process. */
   if (am_i_forked)
@@ -903,11 +1813,26 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
 
   /* Return number of bytes sent. Need to subtract some because the return value
      is actually the size of the TCP segment instead of the cTCP segment. */
-  if (n >= (long int)TCP_HDR_SIZE)
-    return n - (TCP_HDR_SIZE + IP_HDR_SIZE - sizeof(ctcp_segment_t));
+  if (n >= (long int)(total_len - len))
+    return n - (total_len - len);
   return n;
 }
 
+/**
+ * Sends a cTCP segment to a destination associated with the provided
+ * connection object.
+ *
+ * conn: Connection object.
+ * segment: Pointer to cTCP segment to send.
+ * len: Length of the segment (including the cTCP header and data).
+ *
+ * returns: The number of bytes actually sent, 0 if nothing was sent, -1 if
+ *          there in an error.
+ */
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  return conn_send_at(conn, segment, len, 0);
+}
+
 /**
  * Writes a buffer to STDOUT or the program associated with this connection.
  * If called with a length of 0, an EOF is recorded.
@@ -928,27 +1853,31 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     return 0;
   }
 
+  struct iovec iov = { (void *) buf, len };
+  return conn_outputv(conn, &iov, 1);
+}
+
+int conn_outputv(conn_t *conn, const struct iovec *iov, int iovcnt) {
+  ASSERT_CONN;
+  /* If already wrote EOF, can't write more. */
+  if (conn->wrote_eof)
+    return 0;
+
   /* If already wrote out an error, can't continue writing. */
   if (conn->wrote_err) {
     fprintf(stderr, "[ERROR] Attempting to write after error\n");
     return -1;
   }
 
-  int left = len;
-  int w = 0;
-
   /* See if there is actually room to output. */
   if (!conn_bufspace(conn))
     return 0;
 
-  /* Nothing in the output queue. Output immediately to the appropriate
-     interface. */
-  if (!conn->out_queue) {
-    if (run_program)
-      w = write(conn->stdin, buf, len);
-    else
-      w = write(STDOUT_FILENO, buf, len);
-
+  /* Nothing in the output ring. Output immediately to the appropriate
+     interface, all buffers in one writev(). */
+  size_t written = 0;
+  if (conn->out_len == 0) {
+    ssize_t w = writev(run_program ? conn->stdin : STDOUT_FILENO, iov, iovcnt);
     if (w < 0) {
       if (errno != EAGAIN) {
         if (run_program)
@@ -959,32 +1888,21 @@ int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
     }
     /* Write as much as possible. Keep track of how much was written. */
     else {
-      buf += w;
-      left -= w;
+      written = w;
     }
   }
 
-  /* Put the rest in an output queue. */
-  if (left > 0) {
-    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
-    chunk->next = NULL;
-    chunk->size = left;
-    chunk->used = 0;
-    memcpy(chunk->buf, buf, left);
-
-    /* Update pointers. */
-    *conn->out_queue_tail = chunk;
-    conn->out_queue_tail = &chunk->next;
-  }
+  /* Put the rest in the output ring. */
+  written += queue_output(conn, iov, iovcnt, written);
 
-  /* If there is stuff in the queue, create an event. */
-  if (conn->out_queue) {
+  /* If there is stuff in the ring, create an event. */
+  if (conn->out_len > 0) {
     if (run_program)
       events[conn->stdin].events |= POLLOUT;
     else
       events[STDOUT_FILENO].events |= POLLOUT;
   }
-  return len;
+  return written;
 }
 
 /**
@@ -998,19 +1916,28 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
   char buf[MAX_PACKET_SIZE];
 
   /* Send a SYN segment to the server. */
+  int64_t syn_us = time_read_us();
   if (send_syn(config->sconn))
     exit(EXIT_FAILURE);
 
-  /* Wait to receive SYN-ACK. */
-  int r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL);
+  /* Wait to receive SYN-ACK. The wait is the first RTT sample. */
+  int r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL, NULL);
   while (r <= 0){
-    r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL);
+    r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL, NULL);
   }
+  ctcp_cfg->handshake_rtt_us = MAX(time_read_us() - syn_us, 1);
 
   tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
 
-  /* Set window size for the other host. */
+  /* Set window size for the other host, and use SACK, timestamps and ACK rate
+     requests if both offered them. Hosts that don't know TCP options offer
+     none, so they never get options they would take for data. */
   ctcp_cfg->send_window = ntohs(synack->window);
+  ctcp_options_t options;
+  parse_tcp_options(synack, 0, &options);
+  ctcp_cfg->sack = ctcp_cfg->sack && options.sack_permitted;
+  ctcp_cfg->timestamps = ctcp_cfg->timestamps && options.timestamps;
+  ctcp_cfg->ack_rate = ctcp_cfg->ack_rate && options.ack_rate > 0;
 
   /* If an ACK is received instead of a SYN-ACK, continue previous
      connection. Get sequence numbers from previous connection. */
@@ -1033,6 +1960,24 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
   return config->sconn;
 }
 
+/**
+ * Gives a connection the weight and shaper class listed with --shape for the
+ * client's port, if there is one.
+ *
+ * conn: The connection.
+ * cfg: The connection's own copy of the configuration.
+ */
+static void shape_connection(conn_t *conn, ctcp_config_t *cfg) {
+  int i;
+  for (i = 0; i < opt_num_shapes; i++) {
+    if (opt_shapes[i].port == conn->port) {
+      cfg->weight = opt_shapes[i].weight;
+      cfg->priority = opt_shapes[i].priority;
+      return;
+    }
+  }
+}
+
 /**
  * [Server only]
  * Handle a new connection from a client. Set up connection details and
@@ -1063,6 +2008,14 @@ conn_t *tcp_new_connection(char *pkt) {
   conn->ackno = conn->their_init_seqno + 1;
   conn_add(conn);
 
+  /* Use SACK, timestamps and ACK rate requests if the client offers them too.
+     The SYN-ACK says so. */
+  ctcp_options_t options;
+  parse_tcp_options(syn, 0, &options);
+  ctcp_cfg->sack = opt_sack && options.sack_permitted;
+  ctcp_cfg->timestamps = opt_timestamps && options.timestamps;
+  ctcp_cfg->ack_rate = options.ack_rate > 0;
+
   /* Send a SYN-ACK to the client. */
   send_synack(conn);
 
@@ -1070,6 +2023,7 @@ conn_t *tcp_new_connection(char *pkt) {
   ctcp_cfg->send_window = ntohs(syn->window);
   ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
   memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
+  shape_connection(conn, config_copy);
 
   /* Student code. */
   ctcp_state_t *state = ctcp_init(conn, config_copy);
@@ -1145,6 +2099,186 @@ void delete_all_connections() {
   }
 }
 
+/**
+ * Hands a received packet to the protocol: a segment on an established
+ * connection goes to student code, a SYN sets up a new connection.
+ *
+ * conn: Connection the packet belongs to, or NULL if none.
+ * pkt: The raw packet.
+ * segment: The packet translated into a cTCP segment, NULL if conn is NULL.
+ *          Freed by this function or by student code.
+ * len: Length of the raw packet.
+ * rx_time_us: Kernel receive timestamp, 0 if none.
+ */
+void deliver_packet(conn_t *conn, char *pkt, ctcp_segment_t *segment,
+                    int len, int64_t rx_time_us) {
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+
+  /* Packet from an established connection. Pass to student code. */
+  if (conn != NULL) {
+    len = len - IP_HDR_SIZE - tcp_hdr_len(tcp_hdr) + sizeof(ctcp_segment_t);
+
+    /* Don't log or forward to student code if it's an ACK from a new
+       connection. */
+    if (tcp_hdr->th_sport == new_connection &&
+        (segment->flags & TH_ACK) &&
+        ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
+      new_connection = 0;
+      free(segment);
+    }
+    else {
+      if (log_file != -1 || test_debug_on) {
+        log_segment(log_file, config->ip_addr, config->port, conn,
+                    segment, len, false, unix_socket);
+      }
+      conn->rx_time_us = rx_time_us;
+      parse_tcp_options(tcp_hdr, conn->init_seqno, &conn->rx_options);
+      rx_batch_touch(conn);
+      ctcp_receive(conn->state, segment, len);
+    }
+  }
+
+  /* New connection. */
+  else if (tcp_hdr->th_flags & TH_SYN) {
+    conn_t *conn = tcp_new_connection(pkt);
+
+    /* Start a new program associated with this client. */
+    if (run_program && conn)
+      execute_program(conn);
+    if (conn)
+      new_connection = tcp_hdr->th_sport;
+  }
+}
+
+/**
+ * Whether a connection is still in the list and not being deleted. Packets
+ * queued by the I/O thread may outlive their connection.
+ */
+bool conn_is_live(conn_t *conn) {
+  conn_t *curr;
+  for (curr = get_connections(); curr != NULL; curr = curr->next) {
+    if (curr == conn)
+      return !conn->delete_me;
+  }
+  return false;
+}
+
+/**
+ * Finishes delivering a batch: runs the deferred per-connection work once for
+ * every connection that got segments.
+ */
+void rx_batch_end() {
+  int i;
+  rx_batch.active = false;
+  for (i = 0; i < rx_batch.num_touched; i++) {
+    conn_t *conn = rx_batch.touched[i];
+    if (conn_is_live(conn))
+      ctcp_output(conn->state);
+  }
+  rx_batch.num_touched = 0;
+}
+
+/**
+ * Delivers every packet the I/O thread has queued and gives the buffers back.
+ *
+ * returns: The number of packets delivered.
+ */
+int deliver_pipelined_packets() {
+  int delivered = 0;
+  eventfd_t count;
+  eventfd_read(pipeline.rx_event, &count);
+
+  rx_item_t *item;
+  rx_batch_begin();
+  while ((item = spsc_ring_pop(pipeline.rx_ring)) != NULL) {
+    if (item->conn != NULL && !conn_is_live(item->conn))
+      free(item->segment);
+    else
+      deliver_packet(item->conn, item->buf, item->segment, item->len,
+                     rx_timestamp_to_monotonic_us(&item->rx_ts));
+    spsc_ring_push(pipeline.rx_free, item);
+    delivered++;
+  }
+  rx_batch_end();
+  return delivered;
+}
+
+/**
+ * Receives up to opt_rx_batch packets with one system call and runs them
+ * through the receive path a stage at a time: filter and connection lookup,
+ * then translation to cTCP, then delivery.
+ *
+ * returns: The number of packets received, 0 if none, -1 on failure.
+ */
+int receive_batch() {
+  struct mmsghdr msgs[RX_BATCH_MAX];
+  struct iovec iovs[RX_BATCH_MAX];
+  char control[RX_BATCH_MAX][CMSG_SPACE(sizeof(struct timespec))];
+  int i, n = opt_rx_batch;
+
+  memset(msgs, 0, sizeof(msgs[0]) * n);
+  for (i = 0; i < n; i++) {
+    iovs[i].iov_base = rx_batch.bufs[i];
+    iovs[i].iov_len = MAX_PACKET_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+
+  /* Stage 1: receive. */
+  n = recvmmsg(config->socket, msgs, n, MSG_DONTWAIT, NULL);
+  if (n <= 0)
+    return n;
+  rx_batch.count = n;
+  for (i = 0; i < n; i++) {
+    struct timespec ts;
+    rx_batch.lens[i] = msgs[i].msg_len;
+    rx_timestamp_from_msg(&msgs[i].msg_hdr, &ts);
+    rx_batch.rx_time_us[i] = rx_timestamp_to_monotonic_us(&ts);
+  }
+
+  /* Stage 2: filter and find the connection. */
+  for (i = 0; i < n; i++) {
+    if (i + 1 < n)
+      __builtin_prefetch(rx_batch.bufs[i + 1] + IP_HDR_SIZE);
+    rx_batch.conns[i] = NULL;
+    rx_batch.lens[i] = packet_filter(rx_batch.bufs[i], rx_batch.lens[i],
+                                     &rx_batch.conns[i]);
+  }
+
+  /* Stage 3: translate to cTCP. */
+  for (i = 0; i < n; i++) {
+    if (i + 1 < n && rx_batch.conns[i + 1] != NULL)
+      __builtin_prefetch(rx_batch.conns[i + 1]);
+    rx_batch.segments[i] = NULL;
+    if (rx_batch.lens[i] > 0 && rx_batch.conns[i] != NULL) {
+      rx_batch.segments[i] = convert_to_ctcp(rx_batch.conns[i],
+                                             rx_batch.bufs[i],
+                                             rx_batch.lens[i]);
+    }
+  }
+
+  /* Stage 4: deliver. Output and ACKs run once per connection at the end. */
+  rx_batch_begin();
+  for (i = 0; i < n; i++) {
+    if (i + 1 < n && rx_batch.conns[i + 1] != NULL)
+      __builtin_prefetch(rx_batch.conns[i + 1]->state);
+    if (rx_batch.lens[i] == 0)
+      continue;
+
+    /* An earlier segment in this batch may have closed the connection. */
+    if (rx_batch.conns[i] != NULL && !conn_is_live(rx_batch.conns[i])) {
+      free(rx_batch.segments[i]);
+      continue;
+    }
+    deliver_packet(rx_batch.conns[i], rx_batch.bufs[i], rx_batch.segments[i],
+                   rx_batch.lens[i], rx_batch.rx_time_us[i]);
+  }
+  rx_batch_end();
+  return n;
+}
+
 /**
  * Main loop. Handles the following:
  *   - Input from STDIN.
@@ -1155,15 +2289,31 @@ void delete_all_connections() {
 void do_loop() {
   char buf[MAX_PACKET_SIZE];
   conn_t *conn = NULL;
+  int64_t last_rx_us = 0;
 
   while (true) {
     memset(buf, 0, MAX_PACKET_SIZE);
-    poll(events, NUM_POLL + num_connected,
-         need_timer_in(&last_timeout, ctcp_cfg->timer));
+
+    /* Spin while packets are still arriving within the busy-poll budget,
+       otherwise block until something happens or the next departure is due. */
+    update_input_polling();
+    bool spinning = opt_busy_poll_us > 0 &&
+      monotonic_current_time_us() - last_rx_us < opt_busy_poll_us;
+    if (spinning) {
+      poll(events, NUM_POLL + num_connected, 0);
+      busy_poll_stats.spins++;
+    }
+    else {
+      poll_until_next_event(NUM_POLL + num_connected);
+      busy_poll_stats.blocks++;
+    }
+
+    /* Read the clock once. Everything done in this iteration uses it. */
+    time_refresh();
 
     /* Input from stdin. Server will only send to most-recently connected
        client. */
-    if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
+    if (!run_program && events[STDIN_FILENO].revents & (POLLIN | POLLHUP)) {
       conn = get_connections();
 
       if (conn != NULL)
@@ -1182,7 +2332,7 @@ void do_loop() {
     if (run_program) {
       conn = get_connections();
       while (conn != NULL) {
-        if (conn->poll_fd->revents & POLLIN) {
+        if (conn->poll_fd->revents & (POLLIN | POLLHUP)) {
           ctcp_read(conn->state);
         }
         conn = conn->next;
@@ -1190,56 +2340,46 @@ void do_loop() {
     }
 
     /* Receive packet on socket from other hosts. Ignore packets if they are
-       not large enough or not for us. */
+       not large enough or not for us. In pipelined mode the I/O thread has
+       already received and translated them. */
     if (events[2].revents & POLLIN) {
-      conn = NULL;
-      int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
-      if (len >= FULL_HDR_SIZE) {
-        tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
-
-        /* Packet from an established connection. Pass to student code. */
-        if (conn != NULL) {
-          ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
-          len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
-
-          /* Don't log or forward to student code if it's an ACK from a new
-             connection. */
-          if (tcp_hdr->th_sport == new_connection &&
-              (segment->flags & TH_ACK) &&
-              ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
-            new_connection = 0;
-            free(segment);
-          }
-          else {
-            if (log_file != -1 || test_debug_on) {
-              log_segment(log_file, config->ip_addr, config->port, conn,
-                          segment, len, false, unix_socket);
-            }
-            ctcp_receive(conn->state, segment, len);
-          }
+      int received = 0;
+      if (pipeline.running) {
+        received = deliver_pipelined_packets();
+      }
+      else if (opt_rx_batch > 1) {
+        received = receive_batch();
+      }
+      else {
+        conn = NULL;
+        struct timespec rx_ts;
+        int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn,
+                              &rx_ts);
+        if (len > 0)
+          received = 1;
+        if (len >= FULL_HDR_SIZE) {
+          ctcp_segment_t *segment =
+            conn != NULL ? convert_to_ctcp(conn, buf, len) : NULL;
+          deliver_packet(conn, buf, segment, len,
+                         rx_timestamp_to_monotonic_us(&rx_ts));
         }
+      }
 
-        /* New connection. */
-        else if (tcp_hdr->th_flags & TH_SYN) {
-          conn_t *conn = tcp_new_connection(buf);
-
-          /* Start a new program associated with this client. */
-          if (run_program && conn)
-            execute_program(conn);
-          if (conn)
-            new_connection = tcp_hdr->th_sport;
-        }
+      if (received > 0) {
+        last_rx_us = monotonic_current_time_us();
+        if (spinning)
+          busy_poll_stats.spin_hits++;
       }
     }
 
     /* Check if timer is up. */
-    if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
+    if (need_timer_in(last_timeout_us, ctcp_cfg->timer) == 0) {
       ctcp_timer();
-      get_time(&last_timeout);
+      last_timeout_us = time_now_us();
     }
 
-    /* Timer for pacing. 
-      Send a segment at every interval if there are segments in tx queue 
+    /* Timer for pacing.
+      Send the segments whose departure time has come.
       */
     ctcp_pacing_timer();
 
@@ -1271,6 +2411,13 @@ void setup_poll() {
   socket->events = POLLIN | POLLHUP | POLLERR;
   async(config->socket);
 
+  /* Hand the socket to the I/O thread and wait for its packets instead. */
+  if (opt_pipeline) {
+    pipeline_start();
+    socket->fd = pipeline.rx_event;
+    socket->events = POLLIN;
+  }
+
   /* Used to detect if a network service has closed. */
   signal(SIGPIPE, SIG_IGN);
 }
@@ -1286,6 +2433,7 @@ void end_client() {
   }
 
   delete_all_connections();
+  pipeline_flush();
   close(config->socket);
   fprintf(stderr, "[INFO] Disconnected from server\n");
   exit(EXIT_SUCCESS);
@@ -1362,12 +2510,69 @@ static void usage(char *progname) {
     "   [--corrupt corrupt_percent]\n"
     "   [--delay delay_percent]\n"
     "   [--duplicate duplicate_percent]\n"
+    "   [--txtime]\n"
+    "   [--conn-stats]\n"
+    "   [--busy-poll budget_us]\n"
+    "   [--busy-poll-sock usec]\n"
+    "   [--tsc]\n"
+    "   [--pipeline]\n"
+    "   [--rx-batch packets]\n"
+    "   [--alloc-stats]\n"
+    "   [--binary]\n"
+    "   [--notsent-lowat bytes]\n"
+    "   [--autocork usec]\n"
+    "   [--file path]\n"
+    "   [--max-rate bytes_per_sec]\n"
+    "   [--total-rate bytes_per_sec]\n"
+    "   [--weight weight]\n"
+    "   [--priority]\n"
+    "   [--shape client_port:weight[:control]]  [server only]\n"
+    "   [--gro-segments segments]\n"
+    "   [--gro-bytes bytes]\n"
+    "   [--ack-frequency segments]\n"
+    "   [--ack-delay usec]\n"
+    "   [--no-sack]\n"
+    "   [--no-rack]\n"
+    "   [--rto-min usec]\n"
+    "   [--rto-max usec]\n"
+    "   [--no-timestamps]\n"
+    "   [--no-frto]\n"
     "   [-- program arg1 arg2 ...]\n\n",
     progname
   );
   exit(1);
 }
 
+/**
+ * Parses a --shape spec: client_port:weight, or client_port:weight:control to
+ * put the client in the control class.
+ *
+ * returns: 0 on success, -1 if the spec is malformed or there are more specs
+ *          than clients.
+ */
+static int parse_shape(const char *spec) {
+  char *end;
+  if (opt_num_shapes == MAX_NUM_CLIENTS)
+    return -1;
+
+  long port = strtol(spec, &end, 10);
+  if (end == spec || *end != ':' || port <= 0 || port > 65535)
+    return -1;
+  const char *weight_str = end + 1;
+  long weight = strtol(weight_str, &end, 10);
+  if (end == weight_str || weight < 1)
+    return -1;
+  bool priority = strcmp(end, ":control") == 0;
+  if (*end != '\0' && !priority)
+    return -1;
+
+  opt_shapes[opt_num_shapes].port = port;
+  opt_shapes[opt_num_shapes].weight = weight;
+  opt_shapes[opt_num_shapes].priority = priority;
+  opt_num_shapes++;
+  return 0;
+}
+
 int main(int argc , char *argv[]) {
   /* Get program name. */
   char *progname = strrchr(argv[0], '/');
@@ -1402,6 +2607,33 @@ int main(int argc , char *argv[]) {
     { "duplicate", required_argument, NULL, 'q' },
     { "logging", no_argument, NULL, 'l' },
     { "lab5", no_argument, NULL, 'f' },
+    { "txtime", no_argument, NULL, 'x' },
+    { "conn-stats", no_argument, NULL, 'g' },
+    { "busy-poll", required_argument, NULL, 'b' },
+    { "busy-poll-sock", required_argument, NULL, 'k' },
+    { "tsc", no_argument, NULL, 'o' },
+    { "pipeline", no_argument, NULL, 'i' },
+    { "rx-batch", required_argument, NULL, 'v' },
+    { "alloc-stats", no_argument, NULL, 'a' },
+    { "binary", no_argument, NULL, 'n' },
+    { "notsent-lowat", required_argument, NULL, 'u' },
+    { "autocork", required_argument, NULL, 'j' },
+    { "file", required_argument, NULL, 'h' },
+    { "max-rate", required_argument, NULL, 'M' },
+    { "total-rate", required_argument, NULL, 'T' },
+    { "weight", required_argument, NULL, 'W' },
+    { "priority", no_argument, NULL, 'P' },
+    { "shape", required_argument, NULL, 'C' },
+    { "gro-segments", required_argument, NULL, 'G' },
+    { "gro-bytes", required_argument, NULL, 'B' },
+    { "ack-frequency", required_argument, NULL, 'A' },
+    { "ack-delay", required_argument, NULL, 'D' },
+    { "no-sack", no_argument, NULL, 'S' },
+    { "no-rack", no_argument, NULL, 'R' },
+    { "rto-min", required_argument, NULL, 'N' },
+    { "rto-max", required_argument, NULL, 'X' },
+    { "no-timestamps", no_argument, NULL, 'Q' },
+    { "no-frto", no_argument, NULL, 'F' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -1467,6 +2699,109 @@ int main(int argc , char *argv[]) {
     case 'f':
       lab5_mode = true;
       break;
+    /* Pace with SO_TXTIME departure times. */
+    case 'x':
+      opt_txtime = true;
+      break;
+    /* Per-connection counters. */
+    case 'g':
+      opt_conn_stats = true;
+      break;
+    /* Hybrid busy-poll receive. */
+    case 'b':
+      opt_busy_poll_us = atoi(optarg);
+      break;
+    /* Kernel busy polling on the socket. */
+    case 'k':
+      opt_busy_poll_sock_us = atoi(optarg);
+      break;
+    /* Calibrated TSC as the time source. */
+    case 'o':
+      time_use_tsc();
+      break;
+    /* Separate I/O thread. */
+    case 'i':
+      opt_pipeline = true;
+      break;
+    /* Receive and process packets in batches. */
+    case 'v':
+      opt_rx_batch = MAX(1, MIN(atoi(optarg), RX_BATCH_MAX));
+      break;
+    /* Pool allocation counters. */
+    case 'a':
+      opt_alloc_stats = true;
+      break;
+    /* Binary passthrough of input. */
+    case 'n':
+      opt_binary = true;
+      break;
+    /* Stop reading input while this much is waiting to be sent. */
+    case 'u':
+      opt_notsent_lowat = atoi(optarg);
+      break;
+    /* Hold partial segments for more input, 0 to turn off. */
+    case 'j':
+      opt_autocork_us = atoi(optarg);
+      break;
+    /* Send a file instead of STDIN. */
+    case 'h':
+      opt_input_file = optarg;
+      break;
+    /* Shaping: rate caps, weight and control class. */
+    case 'M':
+      opt_max_rate = strtoull(optarg, NULL, 10);
+      break;
+    case 'T':
+      opt_total_rate = strtoull(optarg, NULL, 10);
+      break;
+    case 'W':
+      opt_weight = MAX(1, atoi(optarg));
+      break;
+    case 'P':
+      opt_priority = true;
+      break;
+    /* Weight and class of one client, by its port. */
+    case 'C':
+      if (parse_shape(optarg) < 0)
+        usage(progname);
+      break;
+    /* Receive coalescing limits. */
+    case 'G':
+      opt_gro_segments = atoi(optarg);
+      break;
+    case 'B':
+      opt_gro_bytes = atoi(optarg);
+      break;
+    /* Delayed ACKs. */
+    case 'A':
+      opt_ack_frequency = MAX(1, MIN(atoi(optarg), UINT8_MAX));
+      break;
+    case 'D':
+      opt_ack_delay_us = atoi(optarg);
+      break;
+    /* Don't offer SACK. */
+    case 'S':
+      opt_sack = false;
+      break;
+    /* Detect loss by the retransmission timeout only. */
+    case 'R':
+      opt_rack = false;
+      break;
+    /* Bounds of the retransmission timeout. */
+    case 'N':
+      opt_rto_min_us = MAX(1, atoi(optarg));
+      break;
+    case 'X':
+      opt_rto_max_us = MAX(1, atoi(optarg));
+      break;
+    /* Don't offer timestamps. */
+    case 'Q':
+      opt_timestamps = false;
+      break;
+    /* Retransmit everything outstanding on a timeout, without F-RTO. */
+    case 'F':
+      opt_frto = false;
+      break;
     default:
       usage(progname);
       break;
@@ -1481,6 +2816,18 @@ int main(int argc , char *argv[]) {
     usage(progname);
   }
 
+  /* Send the file as STDIN. A file is shipped as is, without network line
+     endings. */
+  if (opt_input_file != NULL) {
+    int fd = open(opt_input_file, O_RDONLY);
+    if (fd < 0 || dup2(fd, STDIN_FILENO) < 0) {
+      perror("[ERROR] Opening input file");
+      return 1;
+    }
+    close(fd);
+    opt_binary = true;
+  }
+
   /* Construct log file if logging is turned on. Don't create a file if not
      logging data, since that is only used for testing purposes. */
   if (log_file == 0) {
@@ -1505,6 +2852,25 @@ int main(int argc , char *argv[]) {
   cfg.send_window = window * MAX_SEG_DATA_SIZE;
   cfg.timer = TIMER_INTERVAL;
   cfg.rt_timeout = RT_INTERVAL;
+  cfg.txtime = opt_txtime;
+  cfg.conn_stats = opt_conn_stats;
+  cfg.notsent_lowat = opt_notsent_lowat;
+  cfg.autocork_us = opt_autocork_us;
+  cfg.max_pacing_rate = opt_max_rate;
+  cfg.total_rate = opt_total_rate;
+  cfg.weight = opt_weight;
+  cfg.priority = opt_priority;
+  cfg.gro_segments = opt_gro_segments;
+  cfg.gro_bytes = opt_gro_bytes;
+  cfg.ack_frequency = opt_ack_frequency;
+  cfg.ack_delay_us = opt_ack_delay_us;
+  cfg.ack_rate = true;
+  cfg.sack = opt_sack;
+  cfg.rack = opt_rack;
+  cfg.rto_min_us = opt_rto_min_us;
+  cfg.rto_max_us = MAX(opt_rto_max_us, opt_rto_min_us);
+  cfg.timestamps = opt_timestamps;
+  cfg.frto = opt_frto;
 
   /* Used for polling later. */
   struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS];
@@ -10,7 +10,9 @@
 #define CTCP_SYS_INTERNAL_H
 
 #include "ctcp.h"
+#include "ctcp_pool.h"
 #include "ctcp_sys.h"
+#include "ctcp_time.h"
 #include "ctcp_utils.h"
 
 #define DEFAULT_PORT 80
@@ -41,6 +43,22 @@
 /** Timer interval (for calls to ctcp_timer) in milliseconds. */
 #define TIMER_INTERVAL 40
 
+/** Longest a partial segment is held back for more input, in microseconds. */
+#define AUTOCORK_INTERVAL 1000
+
+/** Most in-order bytes coalesced into one delivery and ACK. */
+#define GRO_MAX_BYTES (64 * 1024)
+
+/** Longest an ACK is held back (delayed ACK), in microseconds. */
+#define DELAYED_ACK_INTERVAL 1000
+
+/** Most full segments covered by one delayed ACK. */
+#define ACK_FREQUENCY_MAX 16
+
+/** Bounds of the retransmission timeout, in microseconds. */
+#define RTO_MIN_INTERVAL 10000
+#define RTO_MAX_INTERVAL 60000000
+
 /** Connection timeout interval in seconds. */
 #define CONN_TIMEOUT 10
 
@@ -61,21 +79,10 @@
 #define CHILD_READ_FD (pipes[PARENT_WRITE_PIPE][READ_FD])
 #define CHILD_WRITE_FD (pipes[PARENT_READ_PIPE][WRITE_FD])
 
-/** Maximum space for buffering STDOUT for a given connection. */
+/** Maximum space for buffering STDOUT for a given connection. Size of the
+    output ring, a power of two. */
 #define MAX_BUF_SPACE 8192
 
-/**
- * Chunk of output. Used to do asynchronous output. A connection will store
- * a queue of chunks to be outputted later.
- */
-struct chunk {
-  struct chunk *next;
-  size_t size;              /* Size of chunk, in bytes */
-  size_t used;              /* Amount of chunk already outputted */
-  char buf[1];              /* Data */
-} __attribute__((packed));
-typedef struct chunk chunk_t;
-
 
 /**
  * Makes a file descriptor asynchronous.
@@ -93,36 +100,80 @@ int async(int fd) {
 }
 
 /**
- * Gets the current time and stores it into the provided timespec object.
+ * Returns the number of milliseconds until the next timeout. Uses the
+ * monotonic time cached for this loop iteration, so wall-clock adjustments
+ * do not move timers.
  *
- * ts: Timespec object to store result.
+ * last_us: The previous timeout, in monotonic microseconds.
+ * interval: The timeout interval, in milliseconds.
  */
-void get_time(struct timespec *ts) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  ts->tv_sec = tv.tv_sec;
-  ts->tv_nsec = tv.tv_usec * 1000;
+long need_timer_in(int64_t last_us, long interval) {
+  long elapsed = (time_now_us() - last_us) / 1000;
+  if (elapsed >= interval)
+    return 0;
+  return interval - elapsed;
 }
 
 /**
- * Returns the number of milliseconds until the next timeout.
- *
- * last: The previous timeout.
- * interval: The timeout interval.
+ * Latency histogram in microseconds. Values below HIST_LINEAR_US get their own
+ * bucket; above that each power of two is split into HIST_SUB_BUCKETS linear
+ * buckets, so percentiles are accurate to within 1/HIST_SUB_BUCKETS.
  */
-long need_timer_in(const struct timespec *last, long interval) {
-  long elapsed;
-  struct timespec ts;
+#define HIST_LINEAR_US 64
+#define HIST_SUB_BUCKETS 8
+#define HIST_NUM_BUCKETS (HIST_LINEAR_US + 26 * HIST_SUB_BUCKETS)
 
-  get_time(&ts);
-  elapsed = ts.tv_sec - last->tv_sec;
-  if (elapsed > interval / 1000)
-    return 0;
+typedef struct {
+  uint64_t count;
+  uint64_t buckets[HIST_NUM_BUCKETS];
+} latency_hist_t;
 
-  elapsed = elapsed * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-  if (elapsed >= interval)
-    return 0;
-  return interval - elapsed;
+/**
+ * Returns the histogram bucket a value falls into.
+ */
+int hist_bucket(uint64_t value_us) {
+  if (value_us < HIST_LINEAR_US)
+    return value_us;
+
+  int msb = 63 - __builtin_clzll(value_us);
+  int sub = (value_us >> (msb - 3)) & (HIST_SUB_BUCKETS - 1);
+  int bucket = HIST_LINEAR_US + (msb - 6) * HIST_SUB_BUCKETS + sub;
+  return bucket < HIST_NUM_BUCKETS ? bucket : HIST_NUM_BUCKETS - 1;
+}
+
+/**
+ * Returns the smallest value that falls into a bucket.
+ */
+uint64_t hist_bucket_floor(int bucket) {
+  if (bucket < HIST_LINEAR_US)
+    return bucket;
+
+  int msb = (bucket - HIST_LINEAR_US) / HIST_SUB_BUCKETS + 6;
+  int sub = (bucket - HIST_LINEAR_US) % HIST_SUB_BUCKETS;
+  return (1ull << msb) + ((uint64_t) sub << (msb - 3));
+}
+
+/**
+ * Adds a sample to a histogram.
+ */
+void hist_add(latency_hist_t *hist, uint64_t value_us) {
+  hist->buckets[hist_bucket(value_us)]++;
+  hist->count++;
+}
+
+/**
+ * Returns the given percentile (0-100) of a histogram, 0 if it is empty.
+ */
+uint64_t hist_percentile(const latency_hist_t *hist, int percentile) {
+  uint64_t target = (hist->count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  int i;
+  for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= target && seen > 0)
+      return hist_bucket_floor(i);
+  }
+  return 0;
 }
 
 /**
@@ -144,8 +195,21 @@ typedef struct tcphdr tcphdr_t;
 #define TCP_HDR_SIZE sizeof(tcphdr_t)
 #define FULL_HDR_SIZE (sizeof(iphdr_t) + sizeof(tcphdr_t))
 
-/** Maximum packet size (data and headers). */
-#define MAX_PACKET_SIZE (1440 + sizeof(iphdr_t) + sizeof(tcphdr_t))
+/** Most bytes of options a TCP header can carry. */
+#define TCP_OPT_MAX_SIZE 40
+
+/** Maximum packet size (data, headers and options). */
+#define MAX_PACKET_SIZE (1440 + sizeof(iphdr_t) + sizeof(tcphdr_t) + \
+                         TCP_OPT_MAX_SIZE)
+
+/** ACK rate request, sent as an experimental TCP option (RFC 6994): kind,
+    length, 16-bit experiment ID, then the rate. */
+#define TCPOPT_EXPERIMENT 254
+#define TCPOPT_ACK_RATE_EXID 0xAC4B
+#define TCPOLEN_ACK_RATE 5
+
+/** Bytes per SACK block: left and right edge. */
+#define TCPOLEN_SACK_BLOCK 8
 
 /** TCP pseudoheader, used in checksum calculations. */
 struct tcp_pseudoheader {
@@ -184,7 +248,7 @@ bool add_network_line_ending(bool webserver, char *buf, size_t len) {
  * Computes the TCP checksum. Returns the checksum in network order.
  *
  * packet: IP packet with a TCP payload.
- * len: Length of data (0 if no data and only TCP and IP headers).
+ * len: Length of options and data (0 if only TCP and IP headers).
  *
  * returns: The checksum in network order.
  */
@@ -192,7 +256,9 @@ uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
   tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
 
   /* Construct pseudoheader. */
-  tcp_pseudoheader_t *phdr = calloc(TCP_PSEUDOHDR_SIZE + len, 1);
+  char phdr_buf[TCP_PSEUDOHDR_SIZE + MAX_PACKET_SIZE];
+  tcp_pseudoheader_t *phdr = (tcp_pseudoheader_t *) phdr_buf;
+  memset(phdr, 0, TCP_PSEUDOHDR_SIZE);
   phdr->src_addr = packet->saddr;
   phdr->dst_addr = packet->daddr;
   phdr->protocol = IPPROTO_TCP;
@@ -200,13 +266,15 @@ uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
 
   /* Append TCP segment and compute checksum. */
   memcpy(&(phdr->tcp_hdr), tcp_hdr, TCP_HDR_SIZE + len);
-  uint16_t result = cksum(phdr, len + TCP_PSEUDOHDR_SIZE);
-  free(phdr);
-  return result;
+  return cksum(phdr, len + TCP_PSEUDOHDR_SIZE);
 }
 
+/** Raw IP packets built for sending. */
+static ctcp_pool_t packet_pool = POOL_INITIALIZER("packet", MAX_PACKET_SIZE, 64);
+
 /**
- * Creates an IP packet. The resulting packet must be freed by the caller.
+ * Creates an IP packet. The resulting packet must be freed by the caller
+ * with datagram_free().
  * Assumes arguments are in network order.
  *
  * src_ip: Source IP address.
@@ -216,7 +284,8 @@ uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
  */
 char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
   uint16_t total_len = IP_HDR_SIZE + len;
-  char *datagram = calloc(total_len, 1);
+  char *datagram = pool_alloc(&packet_pool);
+  memset(datagram, 0, total_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
 
   /* IP header. */
@@ -237,6 +306,13 @@ char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
   return datagram;
 }
 
+/**
+ * Frees a packet made by create_datagram().
+ */
+void datagram_free(char *datagram) {
+  pool_free(&packet_pool, datagram);
+}
+
 /**
  * Flips a bit in a segment.
  *
@@ -283,17 +359,25 @@ struct conn {
   uint32_t next_seqno;         /* Sequence number of next segment to send */
   uint32_t ackno;              /* Current ack number */
 
+  int64_t rx_time_us;          /* Kernel receive time of the segment being
+                                  delivered (monotonic usec, 0 if none) */
+  ctcp_options_t rx_options;   /* TCP options of the segment being delivered */
+
   int stdin;                   /* STDIN for the program */
   int stdout;                  /* STDOUT for the program */
   struct pollfd *poll_fd;      /* Used for polling for output from program */
 
   bool read_eof;               /* EOF read from STDIN */
+  bool input_throttled;        /* Input is not polled while set */
+  bool input_tail;             /* Line ending owed after the mapped input */
   bool wrote_eof;              /* EOF wrote to STDOUT */
   bool wrote_err;              /* Error writing to STDOUT */
   bool delete_me;              /* Whether or not to delete this object. */
 
-  chunk_t *out_queue;          /* Queue for output to STDOUT */
-  chunk_t **out_queue_tail;    /* End of the output queue */
+  char out_ring[MAX_BUF_SPACE]; /* Output to STDOUT that could not be
+                                   written yet. Circular. */
+  uint32_t out_start;          /* Offset of the oldest byte in out_ring */
+  uint32_t out_len;            /* Bytes waiting in out_ring */
 
   struct conn *next;           /* Linked list of connections */
   struct conn **prev;
@@ -465,6 +465,27 @@ def large_data():
   return result == test_str
 
 
+def batched_receive(flags):
+  """
+  Sends many segments' worth of data at the default window size while both
+  hosts receive packets in batches. It should all be received properly.
+  """
+  test_str = make_random(MAX_SEG_DATA_SIZE * 30)
+  server = start_server(flags=flags)
+  client = start_client(flags=flags)
+
+  write_to(client, test_str)
+  time.sleep(TEST_TIMEOUT)
+  result = read_from(server)
+  return result == test_str
+
+def rx_batch_data():
+  return batched_receive(["--rx-batch", "16"])
+
+def pipelined_data():
+  return batched_receive(["--pipeline"])
+
+
 def unreliability(flag):
   """
   Sends segments unreliably from the client to the server.
@@ -827,6 +848,29 @@ def no_excessive_retrans():
   return True
 
 
+def no_spurious_retrans():
+  """
+  Sends many segments' worth of data from client to server over a path that
+  loses nothing. Every segment should be sent only once: no retransmissions,
+  tail loss probes or timeouts.
+  """
+  test_str = make_random(MAX_SEG_DATA_SIZE * 30)
+  server = start_server()
+  client = start_client()
+
+  write_to(client, test_str)
+  segments = read_segments_from(server)
+  if not segments:
+    return False
+
+  # Look only at data segments sent by client.
+  seqnos = [s.seqno for s in segments
+            if s.source_port == int(CLIENT_PORT) and "FIN" not in s.flags and
+            s.length > CTCP_HEADER_LEN]
+  return len(seqnos) > 0 and len(seqnos) == len(set(seqnos)) and \
+         read_from(server) == test_str
+
+
 def ignores_bad_seqno():
   """
   Sends a complete segment from reference/client to student/server, which
@@ -1022,6 +1066,15 @@ TESTS = [
    different_windows),
   ("advanced", "Window size field set in header", sets_window_size),
   ("advanced", "Supports multiple clients", multiple_clients),
+  ("advanced", "Handles data in receive batches", rx_batch_data,
+   "A large string is placed in client 1's STDIN, with packets received\n" +
+   "in batches (--rx-batch). Checks that all the data is outputted."),
+  ("advanced", "Handles data with pipelined I/O", pipelined_data,
+   "A large string is placed in client 1's STDIN, with packets received\n" +
+   "on an I/O thread (--pipeline). Checks that all the data is outputted."),
+  ("advanced", "No retransmissions on a clean path", no_spurious_retrans,
+   "A large string is placed in client 1's STDIN and nothing is lost.\n" +
+   "Checks that no segment is sent more than once."),
 ]
 
 ################################# TESTER CODE ##################################
@@ -0,0 +1,112 @@
+#include "ctcp_time.h"
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+/** How often the wall-clock offset is re-read, in usec. */
+#define REALTIME_RESYNC_US 1000000
+
+/** How long to spin while calibrating the TSC, in usec. */
+#define TSC_CALIBRATION_US 20000
+
+/** Cached monotonic time, 0 if the clock has never been read. */
+static int64_t now_us = 0;
+
+/** Wall-clock time minus monotonic time, in usec. */
+static int64_t realtime_offset_us = 0;
+static int64_t realtime_synced_at_us = 0;
+
+/** TSC conversion: us = tsc_base_us + ((tsc - tsc_base) * tsc_mult) >> 32. */
+static bool use_tsc = false;
+static uint64_t tsc_base = 0;
+static int64_t tsc_base_us = 0;
+static uint64_t tsc_mult = 0;
+
+static int64_t read_clock_us(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+}
+
+#if defined(__x86_64__)
+static int64_t read_tsc_us() {
+  unsigned __int128 delta = __rdtsc() - tsc_base;
+  return tsc_base_us + (int64_t)((delta * tsc_mult) >> 32);
+}
+#endif
+
+int64_t time_read_us() {
+#if defined(__x86_64__)
+  if (use_tsc)
+    return read_tsc_us();
+#endif
+  return read_clock_us(CLOCK_MONOTONIC);
+}
+
+int64_t time_refresh() {
+  now_us = time_read_us();
+
+  /* Keep the wall-clock offset fresh enough for log timestamps and for
+     converting kernel receive timestamps. */
+  if (realtime_synced_at_us == 0 ||
+      now_us - realtime_synced_at_us >= REALTIME_RESYNC_US) {
+    realtime_offset_us = read_clock_us(CLOCK_REALTIME) - now_us;
+    realtime_synced_at_us = now_us;
+  }
+  return now_us;
+}
+
+int64_t time_now_us() {
+  if (now_us == 0)
+    return time_refresh();
+  return now_us;
+}
+
+long time_now_realtime_ms() {
+  return (time_now_us() + realtime_offset_us) / 1000;
+}
+
+int64_t time_realtime_to_monotonic_us(int64_t realtime_us) {
+  time_now_us();
+  return realtime_us - realtime_offset_us;
+}
+
+bool time_use_tsc() {
+#if defined(__x86_64__)
+  /* Only an invariant TSC ticks at a constant rate across P/C-states. */
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+    fprintf(stderr, "[INFO] No invariant TSC, using CLOCK_MONOTONIC\n");
+    return false;
+  }
+
+  /* Count TSC ticks over a short CLOCK_MONOTONIC interval. */
+  int64_t start_us = read_clock_us(CLOCK_MONOTONIC);
+  uint64_t start_tsc = __rdtsc();
+  int64_t end_us;
+  do {
+    end_us = read_clock_us(CLOCK_MONOTONIC);
+  } while (end_us - start_us < TSC_CALIBRATION_US);
+  uint64_t end_tsc = __rdtsc();
+
+  if (end_tsc <= start_tsc)
+    return false;
+  tsc_mult = ((uint64_t)(end_us - start_us) << 32) / (end_tsc - start_tsc);
+  tsc_base = end_tsc;
+  tsc_base_us = end_us;
+  use_tsc = true;
+
+  fprintf(stderr, "[INFO] Using TSC clock (%.1f MHz)\n",
+          (double)(end_tsc - start_tsc) / (end_us - start_us));
+  time_refresh();
+  return true;
+#else
+  fprintf(stderr, "[INFO] TSC clock not supported here, using "
+                  "CLOCK_MONOTONIC\n");
+  return false;
+#endif
+}
@@ -0,0 +1,63 @@
+/******************************************************************************
+ * ctcp_time.h
+ * -----------
+ * Time source for cTCP. The clock is read once per event-loop iteration and
+ * every caller during that iteration sees the same monotonic timestamp, so
+ * the hot path does not pay for a clock_gettime() per packet and RTT, pacing
+ * and timer decisions agree with each other.
+ *
+ * The clock is CLOCK_MONOTONIC by default. A calibrated TSC can be used
+ * instead on x86-64 machines with an invariant TSC.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TIME_H
+#define CTCP_TIME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Reads the clock and caches the result. The event loop calls this once per
+ * iteration, right after it wakes up.
+ *
+ * returns: The new cached time in monotonic microseconds.
+ */
+int64_t time_refresh();
+
+/**
+ * Returns the cached time in monotonic microseconds. Reads the clock if it
+ * has never been read.
+ */
+int64_t time_now_us();
+
+/**
+ * Reads the clock without touching the cached time. Only for measurements
+ * that need to know how long the current iteration has taken so far.
+ */
+int64_t time_read_us();
+
+/**
+ * Returns the cached time as wall-clock milliseconds since the epoch. Only
+ * meant for logs that need real timestamps.
+ */
+long time_now_realtime_ms();
+
+/**
+ * Converts a CLOCK_REALTIME timestamp (e.g. a kernel receive timestamp) to the
+ * monotonic microsecond scale returned by time_now_us().
+ *
+ * realtime_us: Wall-clock time in microseconds.
+ * returns: The same instant in monotonic microseconds.
+ */
+int64_t time_realtime_to_monotonic_us(int64_t realtime_us);
+
+/**
+ * Switches the time source to the TSC, calibrated against CLOCK_MONOTONIC.
+ * Only available on x86-64 with an invariant TSC.
+ *
+ * returns: true if the TSC is now in use, false if it is unavailable.
+ */
+bool time_use_tsc();
+
+#endif /* CTCP_TIME_H */
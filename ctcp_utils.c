@@ -1,4 +1,5 @@
 #include "ctcp_utils.h"
+#include "ctcp_time.h"
 #include <stdio.h>
 
 uint16_t cksum(const void *_data, uint16_t len) {
@@ -18,26 +19,16 @@ uint16_t cksum(const void *_data, uint16_t len) {
 }
 
 long current_time() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  return time_now_realtime_ms();
 }
 
 int64_t monotonic_current_time_us() {
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+  return time_now_us();
 }
 
 
-int64_t utils_need_timer_in_us(const struct timespec *last, int64_t interval) {
-  struct timespec ts;
-  uint64_t elapsed_us;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-
-  ts.tv_sec = ts.tv_sec - last->tv_sec;
-  ts.tv_nsec = ts.tv_nsec - last->tv_nsec;
-  elapsed_us = ts.tv_sec * 1000000ll + ts.tv_nsec / 1000; 
+int64_t utils_need_timer_in_us(int64_t last_us, int64_t interval) {
+  int64_t elapsed_us = time_now_us() - last_us;
   if (elapsed_us >= interval) {
     return 0;
   }
@@ -54,22 +54,25 @@ static inline void _ctcp_bbr_log_data(long timestamp, uint64_t bdp){
 }
 
 /**
- * Gets the current time in milliseconds.
+ * Gets the current wall-clock time in milliseconds. This is the time cached
+ * for the current event-loop iteration (see ctcp_time.h).
  */
 long current_time();
 
 /**
- * Gets the current time in usec(microseconds).
+ * Gets the current monotonic time in usec(microseconds). This is the time
+ * cached for the current event-loop iteration (see ctcp_time.h), so repeated
+ * calls while handling one packet return the same value.
  */
 int64_t monotonic_current_time_us();
 
 /**
  * Returns the number of microseconds(usec) until the next timeout.
  *
- * last: The previous timeout.
+ * last_us: The previous timeout, from monotonic_current_time_us().
  * interval: The timeout interval.
  */
-int64_t utils_need_timer_in_us(const struct timespec*, int64_t );
+int64_t utils_need_timer_in_us(int64_t last_us, int64_t interval);
 
 /**
  * Prints out the headers of a cTCP segment. Expects the segment to come in